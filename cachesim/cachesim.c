@@ -0,0 +1,889 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Yuichi Nakamura
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * HDS cache trace replay
+ *
+ * Replays HDS disk accesses against src/hdscache.c built on the host and
+ * against the 4-line round-robin cache it replaced, and reports how many
+ * host requests were served without waiting for an SMB2 round trip.
+ *
+ * The trace is the debug log of the firmware with debuglevel 3
+ * ("disk N: read 0xLBA-0xLBA" / "disk N: write 0xLBA" lines).
+ * Without a trace, a synthetic Human68k boot and compile session on a
+ * generated HDS image is replayed.
+ *
+ * The SMB2 server is modelled as a fixed round trip time, with the async
+ * requests in flight completing in parallel.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smb2.h"
+#include "libsmb2.h"
+
+typedef unsigned int nfds_t;
+struct pollfd
+{
+  int fd;
+  short events;
+  short revents;
+};
+int lwip_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+#include "main.h"
+#include "virtual_disk.h"
+#include "config_file.h"
+
+//****************************************************************************
+// Simulated environment
+//****************************************************************************
+
+#define NUNITS          7
+#define MAX_PENDING     1024
+#define TRACE_MAXSECTS  32              // sectors of one host transfer at most
+
+struct diskinfo diskinfo[NUNITS];
+struct config_data config;
+SemaphoreHandle_t remote_sem;
+
+static uint8_t *image[NUNITS];          // contents of the HDS image of each unit
+static struct smb2fh *unit_fh[NUNITS];
+
+static uint64_t now_us;                 // virtual time
+static uint32_t rtt_us = 5000;          // SMB2 round trip time
+static bool in_host;                    // processing a host request
+
+static struct {
+    uint32_t reads;                     // SMB2 read requests
+    uint32_t writes;                    // SMB2 write requests
+    uint32_t waits;                     // host requests which waited for the network
+    uint64_t wait_us;                   // total time the host requests waited
+    uint32_t rreqs;                     // host read requests
+    uint32_t rhits;                     // host read requests served without waiting
+    bool waited;
+} net;
+
+static void net_wait(uint64_t until)
+{
+    if (until <= now_us)
+        return;
+    if (in_host) {
+        net.wait_us += until - now_us;
+        net.waited = true;
+    }
+    now_us = until;
+}
+
+uint32_t time_us_32(void)
+{
+    return (uint32_t)now_us;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(now_us / 1000);
+}
+
+void taskYIELD(void)
+{
+    exit(1);                            // only used to halt on a fatal error
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout)
+{
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    return pdTRUE;
+}
+
+//----------------------------------------------------------------------------
+// Cache arena and flash
+//----------------------------------------------------------------------------
+
+static uint8_t *arena_ptr;
+static size_t arena_size;
+static size_t arena_used;
+
+void *arena_alloc(size_t size)
+{
+    size = (size + 7) & ~7;
+    if (arena_used + size > arena_size)
+        return NULL;
+    void *p = arena_ptr + arena_used;
+    arena_used += size;
+    return p;
+}
+
+size_t arena_avail(void)
+{
+    return arena_size - arena_used;
+}
+
+const uint8_t *bootprof_read(void)
+{
+    return NULL;
+}
+
+void bootprof_write(uint8_t *data, size_t size)
+{
+}
+
+void iostat_add(struct iostat *s, uint32_t start)
+{
+    uint32_t t = time_us_32() - start;
+    s->count++;
+    s->total += t;
+    if (t > s->max)
+        s->max = t;
+}
+
+int iostat_print(char *buf, size_t size, const char *name, struct iostat *s)
+{
+    int len = snprintf(buf, size, "%-14s count=%u avg=%uus max=%uus\n", name, s->count,
+                       s->count ? (uint32_t)(s->total / s->count) : 0, s->max);
+    return (size_t)len < size ? len : (int)(size - 1);
+}
+
+//----------------------------------------------------------------------------
+// SMB2 server
+//----------------------------------------------------------------------------
+
+static struct pending {
+    struct smb2fh *fh;
+    uint8_t *buf;
+    const uint8_t *wbuf;
+    uint32_t count;
+    uint64_t offset;
+    smb2_command_cb cb;
+    void *cb_data;
+    uint64_t done;                      // time when the reply arrives
+} pending[MAX_PENDING];
+static int npending;
+static uint64_t file_pos;
+
+static int fh_unit(struct smb2fh *fh)
+{
+    for (int i = 0; i < NUNITS; i++) {
+        if (unit_fh[i] == fh)
+            return i;
+    }
+    return -1;
+}
+
+static int file_read(struct smb2fh *fh, uint8_t *buf, uint32_t count, uint64_t offset)
+{
+    struct diskinfo *di = &diskinfo[fh_unit(fh)];
+    if (offset >= di->size)
+        return 0;
+    if (count > di->size - offset)
+        count = di->size - offset;
+    memcpy(buf, &image[di - diskinfo][offset], count);
+    return count;
+}
+
+static int file_write(struct smb2fh *fh, const uint8_t *buf, uint32_t count, uint64_t offset)
+{
+    struct diskinfo *di = &diskinfo[fh_unit(fh)];
+    if (offset >= di->size)
+        return 0;
+    if (count > di->size - offset)
+        count = di->size - offset;
+    memcpy(&image[di - diskinfo][offset], buf, count);
+    return count;
+}
+
+static int async_post(struct smb2fh *fh, uint8_t *buf, const uint8_t *wbuf, uint32_t count,
+                      uint64_t offset, smb2_command_cb cb, void *cb_data)
+{
+    if (npending >= MAX_PENDING)
+        return -1;
+    struct pending *p = &pending[npending++];
+    p->fh = fh;
+    p->buf = buf;
+    p->wbuf = wbuf;
+    p->count = count;
+    p->offset = offset;
+    p->cb = cb;
+    p->cb_data = cb_data;
+    p->done = now_us + rtt_us;
+    return 0;
+}
+
+int smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
+                     uint8_t *buf, uint32_t count, uint64_t offset,
+                     smb2_command_cb cb, void *cb_data)
+{
+    net.reads++;
+    return async_post(fh, buf, NULL, count, offset, cb, cb_data);
+}
+
+int smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
+                      const uint8_t *buf, uint32_t count, uint64_t offset,
+                      smb2_command_cb cb, void *cb_data)
+{
+    net.writes++;
+    return async_post(fh, NULL, buf, count, offset, cb, cb_data);
+}
+
+int smb2_lseek(struct smb2_context *smb2, struct smb2fh *fh,
+               int64_t offset, int whence, uint64_t *current_offset)
+{
+    file_pos = offset;                  // SEEK_SET only
+    if (current_offset)
+        *current_offset = file_pos;
+    return 0;
+}
+
+int smb2_write(struct smb2_context *smb2, struct smb2fh *fh,
+               const uint8_t *buf, uint32_t count)
+{
+    net.writes++;
+    net_wait(now_us + rtt_us);
+    int n = file_write(fh, buf, count, file_pos);
+    file_pos += n;
+    return n;
+}
+
+int smb2_get_fd(struct smb2_context *smb2)
+{
+    return 0;
+}
+
+int smb2_which_events(struct smb2_context *smb2)
+{
+    return npending > 0 ? 1 : 0;
+}
+
+/* Complete the requests whose replies have arrived, in the issued order */
+int smb2_service(struct smb2_context *smb2, int revents)
+{
+    int n = 0;
+
+    for (int i = 0; i < npending; i++) {
+        struct pending p = pending[i];
+        if (p.done > now_us) {
+            pending[n++] = p;
+            continue;
+        }
+        int status = p.buf ? file_read(p.fh, p.buf, p.count, p.offset)
+                           : file_write(p.fh, p.wbuf, p.count, p.offset);
+        p.cb(smb2, status, NULL, p.cb_data);
+    }
+    /* callbacks do not issue new requests, so the rest stays in order */
+    npending = n;
+    return 0;
+}
+
+/* Wait up to timeout ms for the first reply */
+int lwip_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    uint64_t first = ~0ull;
+
+    fds->revents = 0;
+    for (int i = 0; i < npending; i++) {
+        if (pending[i].done < first)
+            first = pending[i].done;
+    }
+    if (first == ~0ull)
+        return 0;
+    if (first > now_us) {
+        if (first > now_us + (uint64_t)timeout * 1000)
+            return 0;
+        net_wait(first);
+    }
+    fds->revents = 1;
+    return 1;
+}
+
+//****************************************************************************
+// Trace
+//****************************************************************************
+
+struct req {
+    int unit;
+    bool write;
+    uint32_t lba;
+    int count;
+};
+
+static struct req *trace;
+static int ntrace;
+static int trace_max;
+
+static void trace_add(int unit, bool write, uint32_t lba, int count)
+{
+    if (ntrace >= trace_max) {
+        trace_max = trace_max ? trace_max * 2 : 1024;
+        trace = realloc(trace, trace_max * sizeof(*trace));
+    }
+    trace[ntrace++] = (struct req){ unit, write, lba, count };
+}
+
+/* Load the "disk N: read 0xLBA-0xLBA" lines of the firmware debug log */
+static int trace_load(const char *name)
+{
+    FILE *fp;
+    char line[256];
+
+    if ((fp = fopen(name, "r")) == NULL) {
+        perror(name);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *p = strstr(line, "disk ");
+        char op[8];
+        int unit;
+        unsigned int start, end;
+        int n;
+
+        if (p == NULL ||
+            (n = sscanf(p, "disk %d: %7s 0x%x-0x%x", &unit, op, &start, &end)) < 3 ||
+            unit < 0 || unit >= NUNITS)
+            continue;
+        if (n < 4)
+            end = start;
+        if (end < start || end - start >= TRACE_MAXSECTS)
+            continue;
+        if (strcmp(op, "read") == 0)
+            trace_add(unit, false, start, end - start + 1);
+        else if (strcmp(op, "write") == 0)
+            trace_add(unit, true, start, end - start + 1);
+    }
+    fclose(fp);
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// Synthetic Human68k session
+//----------------------------------------------------------------------------
+
+/*
+ * HDS image with one 16MB Human68k partition (1KB sectors, 1KB clusters,
+ * 16bit FAT). Directory and file contents are not made, only the FAT chains,
+ * since the cache does not look into them.
+ */
+#define SYN_SIZE        (16 * 1024 * 1024 + 0x8000)
+#define SYN_PART        (0x8000 / SECTOR_SIZE)
+#define SYN_PARTKB      (16 * 1024)
+#define SYN_FATSECTS    32                              // in 1KB sectors
+#define SYN_ROOTENTS    512
+#define SYN_FAT         (SYN_PART + 2)
+#define SYN_ROOT        (SYN_FAT + SYN_FATSECTS * 2 * 2)
+#define SYN_DATA        (SYN_ROOT + SYN_ROOTENTS * 32 / SECTOR_SIZE)
+#define SYN_NCLUST      ((SYN_PARTKB * 2 - (SYN_DATA - SYN_PART)) / 2)
+
+#define CLUST_LBA(cl)   (SYN_DATA + ((cl) - 2) * 2)
+
+struct file {
+    uint32_t clust[512];
+    int nclust;
+};
+
+static uint32_t rand_state = 1;
+static uint32_t syn_next = 2;           // next free cluster
+
+static uint32_t rnd(uint32_t n)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state % n;
+}
+
+static void put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    put_be16(p, v >> 16);
+    put_be16(p + 2, v);
+}
+
+static void syn_setfat(uint32_t cl, uint16_t next)
+{
+    for (int i = 0; i < 2; i++) {
+        put_be16(&image[0][(SYN_FAT + i * SYN_FATSECTS * 2) * SECTOR_SIZE + cl * 2], next);
+    }
+}
+
+/* Allocate the clusters of a file, fragmented now and then */
+static void syn_alloc(struct file *f, int kbytes)
+{
+    f->nclust = kbytes < 1 ? 1 : kbytes > 512 ? 512 : kbytes;
+    for (int i = 0; i < f->nclust; i++) {
+        if (i > 0 && rnd(16) == 0)
+            syn_next += 1 + rnd(8);
+        f->clust[i] = syn_next++;
+        if (i > 0)
+            syn_setfat(f->clust[i - 1], f->clust[i]);
+    }
+    syn_setfat(f->clust[f->nclust - 1], 0xffff);
+}
+
+static void syn_image(void)
+{
+    uint8_t *p = image[0] = calloc(1, SYN_SIZE);
+
+    memcpy(p, "X68SCSI1", 8);
+    p += 0x800;                                         // partition table
+    memcpy(p, "X68K", 4);
+    memcpy(p + 16, "Human68k", 8);
+    put_be32(p + 16 + 8, SYN_PART * SECTOR_SIZE / 1024);
+    put_be32(p + 16 + 12, SYN_PARTKB);
+
+    p = &image[0][SYN_PART * SECTOR_SIZE];              // BPB
+    put_be16(p + 0x12, 1024);
+    p[0x14] = 1;
+    p[0x15] = 2;
+    put_be16(p + 0x16, 1);
+    put_be16(p + 0x18, SYN_ROOTENTS);
+    p[0x1d] = SYN_FATSECTS;
+
+    diskinfo[0].size = SYN_SIZE;
+}
+
+/* Read in 1KB sectors as Human68k does */
+static void syn_read(uint32_t lba, int sects)
+{
+    trace_add(0, false, lba, sects);
+}
+
+/* Look up a directory from the top, up to the entry */
+static void syn_dir(const struct file *d, int entry)
+{
+    for (int i = 0; i <= entry * 32 / 1024 && i < d->nclust; i++) {
+        syn_read(CLUST_LBA(d->clust[i]), 2);
+    }
+}
+
+static void syn_rootdir(int entry)
+{
+    for (int i = 0; i <= entry * 32 / 1024; i++) {
+        syn_read(SYN_ROOT + i * 2, 2);
+    }
+}
+
+/* Read the FAT sectors and then the data of a file, in contiguous extents */
+static void syn_file(const struct file *f, bool write)
+{
+    int fatsect = -1;
+    for (int i = 0; i < f->nclust; i++) {
+        int s = f->clust[i] * 2 / 1024;
+        if (s != fatsect)
+            trace_add(0, write, SYN_FAT + s * 2, 2);
+        fatsect = s;
+    }
+    if (write) {
+        for (int i = 0; i < f->nclust; i++) {
+            int s = f->clust[i] * 2 / 1024;
+            if (i == 0 || s != (int)(f->clust[i - 1] * 2 / 1024))
+                trace_add(0, true, SYN_FAT + (SYN_FATSECTS + s) * 2, 2);
+        }
+    }
+    for (int i = 0; i < f->nclust; ) {
+        int n = 1;
+        while (i + n < f->nclust && f->clust[i + n] == f->clust[i] + n &&
+               n * 2 < TRACE_MAXSECTS)
+            n++;
+        trace_add(0, write, CLUST_LBA(f->clust[i]), n * 2);
+        i += n;
+    }
+}
+
+/* Pick one of n files, the first quarter of them taking most of the accesses */
+static int syn_pick(int n)
+{
+    return rnd(4) != 0 ? rnd((n + 3) / 4) : rnd(n);
+}
+
+static void syn_session(void)
+{
+    static struct file sysdir, bindir, incdir, libdir, srcdir, objdir;
+    static struct file human, config, autoexec, drv[8], bin[30], inc[60], lib[10], src[40];
+    static struct file obj[40];
+    int nobj = 0;
+
+    syn_image();
+    syn_alloc(&human, 60);
+    syn_alloc(&config, 1);
+    syn_alloc(&autoexec, 1);
+    syn_alloc(&sysdir, 1);
+    syn_alloc(&bindir, 1);
+    syn_alloc(&incdir, 2);
+    syn_alloc(&libdir, 1);
+    syn_alloc(&srcdir, 2);
+    syn_alloc(&objdir, 2);
+    for (int i = 0; i < countof(drv); i++)
+        syn_alloc(&drv[i], 2 + rnd(18));
+    for (int i = 0; i < countof(bin); i++)
+        syn_alloc(&bin[i], 4 + rnd(28));
+    for (int i = 0; i < countof(inc); i++)
+        syn_alloc(&inc[i], 1 + rnd(4));
+    for (int i = 0; i < countof(lib); i++)
+        syn_alloc(&lib[i], 8 + rnd(24));
+    for (int i = 0; i < countof(src); i++)
+        syn_alloc(&src[i], 2 + rnd(10));
+
+    /* boot: SCSI signature, partition table, driver, boot sector, HUMAN.SYS */
+    syn_read(0, 2);
+    syn_read(0x800 / SECTOR_SIZE, 2);
+    for (uint32_t lba = 0xc00 / SECTOR_SIZE; lba < 0x4000 / SECTOR_SIZE; lba += 8)
+        syn_read(lba, 8);
+    syn_read(SYN_PART, 2);
+    syn_rootdir(0);
+    syn_file(&human, false);
+
+    /* CONFIG.SYS, device drivers and AUTOEXEC.BAT */
+    syn_rootdir(1);
+    syn_file(&config, false);
+    for (int i = 0; i < countof(drv); i++) {
+        syn_rootdir(3);
+        syn_dir(&sysdir, i + 2);
+        syn_file(&drv[i], false);
+    }
+    syn_rootdir(2);
+    syn_file(&autoexec, false);
+    for (int i = 0; i < 10; i++) {
+        syn_rootdir(4);
+        syn_dir(&bindir, i + 2);
+        syn_file(&bin[i], false);
+    }
+
+    /* compile and link the sources one by one */
+    for (int loop = 0; loop < 40; loop++) {
+        int s = syn_pick(countof(src));
+        syn_rootdir(7);
+        syn_dir(&srcdir, s + 2);
+        syn_file(&src[s], false);
+
+        for (int i = 0; i < 3; i++) {
+            int b = i;                                  // cc, cpp and as
+            syn_rootdir(4);
+            syn_dir(&bindir, b + 2);
+            syn_file(&bin[b], false);
+        }
+        for (int i = 0; i < 8; i++) {
+            int h = syn_pick(countof(inc));
+            syn_rootdir(5);
+            syn_dir(&incdir, h + 2);
+            syn_file(&inc[h], false);
+        }
+
+        struct file *o = &obj[nobj < countof(obj) ? nobj++ : rnd(countof(obj))];
+        syn_alloc(o, src[s].nclust * 2 / 3 + 1);
+        syn_rootdir(8);
+        syn_dir(&objdir, o - obj + 2);
+        syn_file(o, true);
+        trace_add(0, true, CLUST_LBA(objdir.clust[(o - obj + 2) * 32 / 1024]), 2);
+
+        if (loop % 10 == 9) {
+            syn_rootdir(4);
+            syn_dir(&bindir, 5);                        // ld
+            syn_file(&bin[5], false);
+            for (int i = 0; i < nobj; i++) {
+                syn_dir(&objdir, i + 2);
+                syn_file(&obj[i], false);
+            }
+            for (int i = 0; i < 3; i++) {
+                syn_rootdir(6);
+                syn_dir(&libdir, i + 2);
+                syn_file(&lib[i], false);
+            }
+        }
+    }
+}
+
+//****************************************************************************
+// Round-robin cache (before the LRU cache)
+//****************************************************************************
+
+#define OLD_CACHE_SECTS     8
+#define OLD_CACHE_SETS      4
+
+static struct old_cache {
+    int unit;
+    uint32_t lba;
+    int sects;
+} old_cache[OLD_CACHE_SETS];
+static int old_next;
+
+/* One sector at a time, and every miss reads 8 sectors synchronously */
+static void old_read(int unit, uint32_t lba)
+{
+    for (int i = 0; i < OLD_CACHE_SETS; i++) {
+        struct old_cache *c = &old_cache[i];
+        if (c->unit == unit && lba >= c->lba && lba < c->lba + c->sects) {
+            return;
+        }
+    }
+    net.reads++;
+    net_wait(now_us + rtt_us);
+    struct old_cache *c = &old_cache[old_next];
+    c->unit = unit;
+    c->lba = lba;
+    c->sects = OLD_CACHE_SECTS;
+    old_next = (old_next + 1) % OLD_CACHE_SETS;
+}
+
+/* Write through, one sector at a time */
+static void old_write(int unit, uint32_t lba)
+{
+    net.writes++;
+    net_wait(now_us + rtt_us);
+}
+
+//****************************************************************************
+// Replay
+//****************************************************************************
+
+static uint32_t gap_us = 1000;          // host time between the requests
+
+struct result {
+    uint32_t rreqs, rhits;
+    uint32_t reads, writes;
+    uint32_t waits;
+    uint64_t wait_us;
+};
+
+static void replay_start(void)
+{
+    memset(&net, 0, sizeof(net));
+}
+
+static void host_begin(void)
+{
+    now_us += gap_us;
+    in_host = true;
+    net.waited = false;
+}
+
+static void host_end(bool write)
+{
+    in_host = false;
+    if (net.waited)
+        net.waits++;
+    if (!write) {
+        net.rreqs++;
+        if (!net.waited)
+            net.rhits++;
+    }
+}
+
+static void replay_result(struct result *res)
+{
+    res->rreqs = net.rreqs;
+    res->rhits = net.rhits;
+    res->reads = net.reads;
+    res->writes = net.writes;
+    res->waits = net.waits;
+    res->wait_us = net.wait_us;
+}
+
+static void replay_old(struct result *res)
+{
+    for (int i = 0; i < OLD_CACHE_SETS; i++) {
+        old_cache[i].unit = -1;
+    }
+    now_us = 0;
+    replay_start();
+
+    for (int i = 0; i < ntrace; i++) {
+        struct req *r = &trace[i];
+        host_begin();
+        for (int j = 0; j < r->count; j++) {
+            if (r->write)
+                old_write(r->unit, r->lba + j);
+            else
+                old_read(r->unit, r->lba + j);
+        }
+        host_end(r->write);
+    }
+    replay_result(res);
+}
+
+static void replay_new(struct result *res, int kbytes, int writeback, int prefetch,
+                       bool verbose)
+{
+    static uint8_t buf[TRACE_MAXSECTS * SECTOR_SIZE];
+    static char stat[4096];
+
+    arena_size = kbytes * 1024;
+    arena_ptr = malloc(arena_size);
+    arena_used = 0;
+    if (arena_avail() < hds_cache_min_size()) {
+        fprintf(stderr, "cache size must be %zuKB at least\n", hds_cache_min_size() / 1024 + 1);
+        exit(1);
+    }
+    now_us = 0;
+    for (int i = 0; i < countof(config.hdswback); i++) {
+        strcpy(config.hdswback[i], writeback ? "1" : "0");
+    }
+    hds_cache_init();
+
+    /* as connect_task() does after opening the images */
+    for (int i = 0; i < NUNITS; i++) {
+        struct diskinfo *di = &diskinfo[i];
+        if (image[i] == NULL)
+            continue;
+        di->type = DTYPE_HDS;
+        di->sfh = unit_fh[i] = (struct smb2fh *)&image[i];
+        di->smb2 = (struct smb2_context *)&image[i];
+        di->sects = (di->size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        di->writeback = writeback;
+        di->fatprefetch = prefetch;
+        hds_cache_quota(di, 0);
+    }
+    replay_start();
+    for (int i = 0; i < NUNITS; i++) {
+        if (diskinfo[i].type == DTYPE_HDS)
+            hds_cache_pin(&diskinfo[i]);
+    }
+    hds_cache_warmup();
+    uint32_t pinreads = net.reads;
+    replay_start();
+
+    for (int i = 0; i < ntrace; i++) {
+        struct req *r = &trace[i];
+        struct diskinfo *di = &diskinfo[r->unit];
+        host_begin();
+        if (r->write) {
+            hds_cache_write(di, r->lba, r->count, buf);
+        } else if (hds_cache_read_cached(di, r->lba, r->count, buf) != 0) {
+            hds_cache_read(di, r->lba, r->count, buf);
+        }
+        host_end(r->write);
+        hds_cache_idle();
+    }
+    hds_cache_flush();
+
+    replay_result(res);
+    if (verbose) {
+        hds_cache_stat(stat, sizeof(stat));
+        printf("%s(pinned at mount: %u reads)\n\n", stat, pinreads);
+    }
+    free(arena_ptr);
+}
+
+static void print_result(const char *name, struct result *r)
+{
+    printf("%-12s %5.1f%% %10u %10u %10u %10.1f\n", name,
+           r->rreqs ? r->rhits * 100.0 / r->rreqs : 0.0,
+           r->reads, r->writes, r->waits, r->wait_us / 1000.0);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: cachesim [-k kbytes] [-t rtt_ms] [-g gap_us] [-w] [-p] [-v] [trace.log]\n"
+            "  -k  cache memory (default 128KB)\n"
+            "  -t  SMB2 round trip time (default 5ms)\n"
+            "  -g  time between host requests (default 1000us)\n"
+            "  -w  write-back mode (HDSn_WRITEBACK: 1)\n"
+            "  -p  FAT aware prefetch (HDS_PREFETCH: 1)\n"
+            "  -v  print the cache statistics\n"
+            "Without a trace, a synthetic boot and compile session is replayed.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int kbytes = 128;
+    int writeback = 0;
+    int prefetch = 0;
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:t:g:wpv")) != -1) {
+        switch (opt) {
+        case 'k':
+            kbytes = atoi(optarg);
+            break;
+        case 't':
+            rtt_us = atoi(optarg) * 1000;
+            break;
+        case 'g':
+            gap_us = atoi(optarg);
+            break;
+        case 'w':
+            writeback = 1;
+            break;
+        case 'p':
+            prefetch = 1;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind < argc) {
+        if (trace_load(argv[optind]) < 0)
+            return 1;
+        /* the images are only as large as the trace needs */
+        for (int i = 0; i < ntrace; i++) {
+            struct diskinfo *di = &diskinfo[trace[i].unit];
+            uint32_t end = (trace[i].lba + trace[i].count) * SECTOR_SIZE;
+            if (end > di->size)
+                di->size = end;
+        }
+        for (int i = 0; i < NUNITS; i++) {
+            if (diskinfo[i].size > 0)
+                image[i] = calloc(1, diskinfo[i].size);
+        }
+    } else {
+        syn_session();
+    }
+
+    uint32_t rsects = 0, wsects = 0;
+    for (int i = 0; i < ntrace; i++) {
+        if (trace[i].write)
+            wsects += trace[i].count;
+        else
+            rsects += trace[i].count;
+    }
+    printf("%d requests, %u sectors read, %u sectors written\n\n", ntrace, rsects, wsects);
+
+    struct result old, new;
+    replay_old(&old);
+    replay_new(&new, kbytes, writeback, prefetch, verbose);
+
+    printf("policy       read hit SMB2 read SMB2 write   waits   wait(ms)\n");
+    print_result("round-robin", &old);
+    print_result("LRU", &new);
+    return 0;
+}
@@ -0,0 +1,7 @@
+#ifndef _HARDWARE_SYNC_H_
+#define _HARDWARE_SYNC_H_
+
+static inline void __mem_fence_acquire(void) {}
+static inline void __mem_fence_release(void) {}
+
+#endif /* _HARDWARE_SYNC_H_ */
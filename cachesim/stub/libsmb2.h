@@ -0,0 +1,24 @@
+/* The part of libsmb2 used by hdscache.c */
+#ifndef _LIBSMB2_H_
+#define _LIBSMB2_H_
+
+#include "smb2.h"
+
+typedef void (*smb2_command_cb)(struct smb2_context *smb2, int status,
+                                void *command_data, void *cb_data);
+
+int smb2_get_fd(struct smb2_context *smb2);
+int smb2_which_events(struct smb2_context *smb2);
+int smb2_service(struct smb2_context *smb2, int revents);
+int smb2_lseek(struct smb2_context *smb2, struct smb2fh *fh,
+               int64_t offset, int whence, uint64_t *current_offset);
+int smb2_write(struct smb2_context *smb2, struct smb2fh *fh,
+               const uint8_t *buf, uint32_t count);
+int smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
+                     uint8_t *buf, uint32_t count, uint64_t offset,
+                     smb2_command_cb cb, void *cb_data);
+int smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
+                      const uint8_t *buf, uint32_t count, uint64_t offset,
+                      smb2_command_cb cb, void *cb_data);
+
+#endif /* _LIBSMB2_H_ */
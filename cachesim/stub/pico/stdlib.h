@@ -0,0 +1,9 @@
+#ifndef _PICO_STDLIB_H_
+#define _PICO_STDLIB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+uint32_t time_us_32(void);
+
+#endif /* _PICO_STDLIB_H_ */
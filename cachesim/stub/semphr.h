@@ -0,0 +1,9 @@
+#ifndef _SEMPHR_H_
+#define _SEMPHR_H_
+
+#include "FreeRTOS.h"
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+
+#endif /* _SEMPHR_H_ */
@@ -0,0 +1,9 @@
+#ifndef _SMB2_H_
+#define _SMB2_H_
+
+#include <stdint.h>
+
+struct smb2_context;
+struct smb2fh;
+
+#endif /* _SMB2_H_ */
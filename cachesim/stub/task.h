@@ -0,0 +1,9 @@
+#ifndef _TASK_H_
+#define _TASK_H_
+
+#include "FreeRTOS.h"
+
+TickType_t xTaskGetTickCount(void);
+void taskYIELD(void);
+
+#endif /* _TASK_H_ */
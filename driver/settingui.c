@@ -395,6 +395,8 @@ int main()
       while (1)
         ;
     }
+    com_setresp(res.respbase, res.respslots);
+    com_setstat(res.statbase, res.statslots);
   }
 
   {
@@ -46,11 +46,18 @@ int scsiid = 6;
 #ifndef XTEST
 
 static struct vdbuf vdbuf_read;
-static struct vdbuf vdbuf_write;
+static struct vdbuf vdbuf_page[VDBUF_MAXPAGE];   // command and response pages
 
 static int seqno = 0;
 static int seqtim = 0;
 static int sect = 0x400000;
+static uint32_t respbase = 0;        // CMD_GETINFO で通知された応答領域 (0: 未使用)
+static uint32_t respslots;
+static uint32_t respslot;
+static uint32_t statbase = 0;        // CMD_GETINFO で通知された状態セクタ領域 (0: 未使用)
+static uint32_t statslots;
+static uint32_t statslot;
+static int frame = 0;                // 1: アラインされたフレーム形式で通信する
 
 void com_init(void)
 {
@@ -61,24 +68,155 @@ void com_init(void)
   seqtim ^= it.sec;
 }
 
-void com_cmdres(void *wbuf, size_t wsize, void *rbuf, size_t rsize)
+/* CMD_GETINFO で通知された応答領域を使う */
+void com_setresp(uint32_t base, uint32_t slots)
 {
-  struct vdbuf_header *h;
-  int wcnt = (wsize - 1) / (512 - 16);
-  int rcnt = (rsize - 1) / (512 - 16);
+  if (slots == 0)
+    return;                 // 応答領域がなければ従来の方法で読み出す
+  respbase = base;
+  respslots = slots;
+  respslot = seqtim % slots;
+}
+
+/* CMD_GETINFO で通知された状態セクタ領域を使う */
+void com_setstat(uint32_t base, uint32_t slots)
+{
+  if (slots == 0 || respbase == 0)
+    return;                 // 状態セクタがなければ応答セクタを直接読み出す
+  statbase = base;
+  statslots = slots;
+  statslot = seqtim % slots;
+  /* settingui は同一バージョンでのみ動作するので常にフレーム形式を使う */
+  frame = 1;
+}
+
+/* 状態セクタでコマンドの完了を待ち、応答のページ数を得る */
+static int com_waitstat(struct vdbuf_header *wh)
+{
+  struct vdstat *st = (struct vdstat *)&vdbuf_read;
+  while (1) {
+    statslot = (statslot + 1) % statslots;
+    _iocs_s_readext(statbase + statslot, 1, scsiid, 1, st);
+    if (memcmp(&st->header, wh, 12) == 0 && st->state == VDSTAT_DONE)
+      return st->header.maxpage;
+  }
+}
+
+/*
+ * アラインされたフレーム形式での送受信
+ * ヘッダ1セクタの後に512バイト単位のデータが続く
+ * 応答のデータは呼び出し元のバッファに直接読み出す
+ */
+static void com_cmdframe(void *wbuf, size_t wsize, void *rbuf, size_t rsize)
+{
+  struct vdbuf_header *h = &vdbuf_page[0].header;
+  int wcnt = (wsize + 511) / 512;
 
-  h = &vdbuf_write.header;
+  memset(&vdbuf_page[0], 0, sizeof(vdbuf_page[0]));
   h->signature = 0x5836385a;    /* "X68Z" */
   h->session = seqtim;
   h->seqno = seqno;
+  h->page = 0;
   h->maxpage = wcnt;
+  h->flags = VDBUF_FRAME;
+  memcpy(&vdbuf_page[1], wbuf, wsize);
+  _iocs_s_writeext(0x20, wcnt + 1, scsiid, 1, vdbuf_page);
+
+  /* 完了を確認してから読み出すので、データのセクタにはヘッダが不要 */
+  int n = com_waitstat(h);
+  int rcnt = (rsize + 511) / 512;
+  if (n > rcnt)
+    n = rcnt;
+  int full = rsize / 512;
+  if (full > n)
+    full = n;
+  respslot = (respslot + 1) % respslots;
+  int rsect = respbase + respslot * VDBUF_MAXPAGE + 1;
+  if (full > 0)
+    _iocs_s_readext(rsect, full, scsiid, 1, rbuf);
+  if (n > full) {
+    /* 512バイトに満たない最後の部分 */
+    _iocs_s_readext(rsect + full, 1, scsiid, 1, &vdbuf_read);
+    memcpy(rbuf + full * 512, &vdbuf_read, rsize - full * 512);
+  }
+  seqno++;
+}
+
+void com_cmdres(void *wbuf, size_t wsize, void *rbuf, size_t rsize)
+{
+  struct vdbuf_header *h;
+  struct vdbuf_header wh;
+  int wcnt = (wsize - 1) / (512 - 16);
+  int rcnt = (rsize - 1) / (512 - 16);
+
+  if (frame) {
+    com_cmdframe(wbuf, wsize, rbuf, rsize);
+    return;
+  }
+
   for (int i = 0; i <= wcnt; i++) {
+    h = &vdbuf_page[i].header;
+    h->signature = 0x5836385a;    /* "X68Z" */
+    h->session = seqtim;
+    h->seqno = seqno;
+    h->maxpage = wcnt;
     h->page = i;
+    h->flags = 0;
     int s = wsize > (512 - 16) ? 512 - 16 : wsize;
-    memcpy(vdbuf_write.buf, wbuf, s);
+    memcpy(vdbuf_page[i].buf, wbuf, s);
     wsize -= s;
     wbuf += s;
-    _iocs_s_writeext(0x20, 1, scsiid, 1, &vdbuf_write);
+  }
+  /* 全ページを1回のSCSIコマンドで書き込む */
+  _iocs_s_writeext(0x20, wcnt + 1, scsiid, 1, vdbuf_page);
+  wh = vdbuf_page[0].header;
+
+  if (respbase != 0) {
+    /*
+     * 応答ごとに応答領域内の次のスロットを読み出す (X68000 Z側のキャッシュ回避)
+     * 先頭ページで最大ページ数を知り、残りのページは1回のSCSIコマンドで読み出す
+     */
+    int n = -1;
+    if (statbase != 0) {
+      n = com_waitstat(&wh);
+      if (n > rcnt)
+        n = rcnt;
+    }
+    while (1) {
+      respslot = (respslot + 1) % respslots;
+      int rsect = respbase + respslot * VDBUF_MAXPAGE;
+      if (n >= 0) {
+        /* ページ数が分かっていれば全ページを1回のSCSIコマンドで読み出す */
+        _iocs_s_readext(rsect, n + 1, scsiid, 1, &vdbuf_page[0]);
+      } else {
+        _iocs_s_readext(rsect, 1, scsiid, 1, &vdbuf_page[0]);
+        if (memcmp(&vdbuf_page[0], &wh, 12) != 0)
+          continue;
+        n = vdbuf_page[0].header.maxpage;
+        if (n > rcnt)
+          n = rcnt;
+        if (n > 0)
+          _iocs_s_readext(rsect + 1, n, scsiid, 1, &vdbuf_page[1]);
+      }
+      {
+        int i;
+        for (i = 0; i <= n; i++) {
+          if (memcmp(&vdbuf_page[i], &wh, 12) != 0)
+            break;
+        }
+        if (i <= n)
+          continue;               // 古いデータが残っていたので次のスロットで読み直す
+      }
+      break;
+    }
+    for (int i = 0; i <= n; i++) {
+      int s = rsize > (512 - 16) ? 512 - 16 : rsize;
+      memcpy(rbuf, vdbuf_page[i].buf, s);
+      rsize -= s;
+      rbuf += s;
+    }
+    seqno++;
+    return;
   }
 
   sect = ((sect - 8) % 0x200000) + 0x200000;
@@ -86,7 +224,7 @@ void com_cmdres(void *wbuf, size_t wsize, void *rbuf, size_t rsize)
   for (int i = 0; i <= rcnt; i++) {
     while (1) {
       _iocs_s_readext(sect + (i & 7), 1, scsiid, 1, &vdbuf_read);
-      if (memcmp(&vdbuf_read, &vdbuf_write, 12) == 0)
+      if (memcmp(&vdbuf_read, &wh, 12) == 0)
         break;
       sect = ((sect - 0x10000) % 0x200000) + 0x200000;
     }
@@ -63,6 +63,8 @@ struct numlist_opt {
 
 /* Communication */
 void com_init(void);
+void com_setresp(uint32_t base, uint32_t slots);
+void com_setstat(uint32_t base, uint32_t slots);
 void com_cmdres(void *wbuf, size_t wsize, void *rbuf, size_t rsize);
 
 /* Drawing */
@@ -27,6 +27,7 @@
 #define _VD_COMMAND_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 /* virtual disk buffer definition */
 
@@ -36,14 +37,30 @@ struct vdbuf_header {
     uint32_t seqno;             // sequence count
     uint8_t page;               // page number
     uint8_t maxpage;            // max page
-    uint8_t reserved[2];
+    uint8_t flags;              // VDBUF_*
+    uint8_t reserved;
 };
 
+#define VDBUF_FRAME     0x01    // aligned frame: this header sector and maxpage raw data sectors
+
 struct vdbuf {
     struct vdbuf_header header;
     uint8_t buf[512 - sizeof(struct vdbuf_header)];
 };
 
+#define VDBUF_MAXPAGE   32      // max pages of a command or a response
+
+/* status sector of the last command received */
+struct vdstat {
+    struct vdbuf_header header; // session and seqno of the command, maxpage of the response
+    uint8_t state;              // VDSTAT_*
+};
+
+#define VDSTAT_NONE     0       // receiving the command
+#define VDSTAT_QUEUED   1       // waiting to run
+#define VDSTAT_RUNNING  2
+#define VDSTAT_DONE     3       // response is ready
+
 int vd_command(uint8_t *cbuf, uint8_t *rbuf);
 
 /* configuration data structure */
@@ -65,11 +82,15 @@ struct config_data {
     char tz[16];
     char tadjust[4];
     char fastconnect[4];
+    char hdswback[4][4];
+    char hdscache[4][8];
+    char hdsprefetch[4];
+    char cachekb[8];
 };
 
 /* scsiremote.sys communication protocol definition */
 
-#define PROTO_VERSION   1
+#define PROTO_VERSION   4
 
 #define CMD_GETINFO     0xff00
 #define CMD_GETCONFIG   0xff01
@@ -108,8 +129,16 @@ struct res_getinfo {
     uint8_t unit;
     uint8_t version;
     uint8_t verstr[16];
+    uint8_t pad[3];             // m68k aligns uint32_t to 2 bytes -- keep the same layout
+    uint32_t respbase;          // first sector of the response window
+    uint32_t respslots;         // number of response slots (VDBUF_MAXPAGE sectors each)
+    uint32_t statbase;          // first sector of the status sector window
+    uint32_t statslots;         // number of status sectors
 };
 
+_Static_assert(offsetof(struct res_getinfo, respbase) == 28, "res_getinfo layout");
+_Static_assert(offsetof(struct res_getinfo, statbase) == 36, "res_getinfo layout");
+
 struct cmd_getconfig {
     uint16_t command;
 };
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <hardware/sync.h>
 #include <hardware/flash.h>
+#include <pico/flash.h>
 
 #include "main.h"
 #include "vd_command.h"
@@ -56,7 +57,7 @@ extern char config_template[];
 // Configuration data
 //****************************************************************************
 
-char configtxt[2048];
+char configtxt[CONFIGTXT_SIZE];
 struct config_data config;
 
 #define CF_HIDDEN   1
@@ -119,6 +120,29 @@ const struct config_item {
       config.tadjust,               sizeof(config.tadjust),         0 },
     { "FASTCONNECT:",               "0",
       config.fastconnect,           sizeof(config.fastconnect),     0 },
+
+    { "HDS0_WRITEBACK:",            "0",
+      config.hdswback[0],           sizeof(config.hdswback[0]),     0 },
+    { "HDS1_WRITEBACK:",            "0",
+      config.hdswback[1],           sizeof(config.hdswback[1]),     0 },
+    { "HDS2_WRITEBACK:",            "0",
+      config.hdswback[2],           sizeof(config.hdswback[2]),     0 },
+    { "HDS3_WRITEBACK:",            "0",
+      config.hdswback[3],           sizeof(config.hdswback[3]),     0 },
+
+    { "HDS0_CACHE:",                "0",
+      config.hdscache[0],           sizeof(config.hdscache[0]),     0 },
+    { "HDS1_CACHE:",                "0",
+      config.hdscache[1],           sizeof(config.hdscache[1]),     0 },
+    { "HDS2_CACHE:",                "0",
+      config.hdscache[2],           sizeof(config.hdscache[2]),     0 },
+    { "HDS3_CACHE:",                "0",
+      config.hdscache[3],           sizeof(config.hdscache[3]),     0 },
+    { "HDS_PREFETCH:",              "0",
+      config.hdsprefetch,           sizeof(config.hdsprefetch),     0 },
+
+    { "CACHE_KB:",                  "0",
+      config.cachekb,               sizeof(config.cachekb),         0 },
 };
 
 //****************************************************************************
@@ -126,11 +150,20 @@ const struct config_item {
 //****************************************************************************
 
 #define CONFIG_ITEMS    (sizeof(config_items) / sizeof(config_items[0]))
+#define CONFIG_ITEMS_v7 32      // up to HDS_PREFETCH:
+#define CONFIG_ITEMS_v6 31      // up to HDS3_CACHE:
+#define CONFIG_ITEMS_v5 27      // up to HDS3_WRITEBACK:
+#define CONFIG_ITEMS_v4 23      // up to FASTCONNECT:
+#define CONFIG_ITEMS_v3 22      // up to TADJUST:
 
 #define CONFIG_FLASH_OFFSET     (0x1f0000)
 #define CONFIG_FLASH_ADDR       ((uint8_t *)(0x10000000 + CONFIG_FLASH_OFFSET))
 #define CONFIG_FLASH_MAGIC_v3   "X68000Z Remote Drive Config v3"
-#define CONFIG_FLASH_MAGIC      "X68000Z Remote Drive Config v4"
+#define CONFIG_FLASH_MAGIC_v4   "X68000Z Remote Drive Config v4"
+#define CONFIG_FLASH_MAGIC_v5   "X68000Z Remote Drive Config v5"
+#define CONFIG_FLASH_MAGIC_v6   "X68000Z Remote Drive Config v6"
+#define CONFIG_FLASH_MAGIC_v7   "X68000Z Remote Drive Config v7"
+#define CONFIG_FLASH_MAGIC      "X68000Z Remote Drive Config v8"
 
 void config_read(void)
 {
@@ -142,25 +175,30 @@ void config_read(void)
 
     const uint8_t *config_flash_addr = CONFIG_FLASH_ADDR;
     const char *p = &config_flash_addr[32];
+    int items = 0;
     if (memcmp(&config_flash_addr[0], CONFIG_FLASH_MAGIC, sizeof(CONFIG_FLASH_MAGIC)) == 0) {
-        for (i = 0; i < CONFIG_ITEMS; i++) {
-            const struct config_item *c = &config_items[i];
-            memcpy(c->value, p, c->valuesz);
-            p += c->valuesz;
-        }
+        items = CONFIG_ITEMS;
+    } else if (memcmp(&config_flash_addr[0], CONFIG_FLASH_MAGIC_v7, sizeof(CONFIG_FLASH_MAGIC_v7)) == 0) {
+        items = CONFIG_ITEMS_v7;
+    } else if (memcmp(&config_flash_addr[0], CONFIG_FLASH_MAGIC_v6, sizeof(CONFIG_FLASH_MAGIC_v6)) == 0) {
+        items = CONFIG_ITEMS_v6;
+    } else if (memcmp(&config_flash_addr[0], CONFIG_FLASH_MAGIC_v5, sizeof(CONFIG_FLASH_MAGIC_v5)) == 0) {
+        items = CONFIG_ITEMS_v5;
+    } else if (memcmp(&config_flash_addr[0], CONFIG_FLASH_MAGIC_v4, sizeof(CONFIG_FLASH_MAGIC_v4)) == 0) {
+        items = CONFIG_ITEMS_v4;
     } else if (memcmp(&config_flash_addr[0], CONFIG_FLASH_MAGIC_v3, sizeof(CONFIG_FLASH_MAGIC_v3)) == 0) {
-        for (i = 0; i < CONFIG_ITEMS - 1; i++) {
-            const struct config_item *c = &config_items[i];
-            memcpy(c->value, p, c->valuesz);
-            p += c->valuesz;
-        }
-        strcpy(config.fastconnect, "0");
-    } else {
-        for (i = 0; i < CONFIG_ITEMS; i++) {
-            const struct config_item *c = &config_items[i];
-            if (c->defval)
-                strcpy(c->value, c->defval);
-        }
+        items = CONFIG_ITEMS_v3;
+    }
+    for (i = 0; i < items; i++) {
+        const struct config_item *c = &config_items[i];
+        memcpy(c->value, p, c->valuesz);
+        p += c->valuesz;
+    }
+    /* items not stored in the flash (older version or no config) get default values */
+    for (; i < CONFIG_ITEMS; i++) {
+        const struct config_item *c = &config_items[i];
+        if (c->defval)
+            strcpy(c->value, c->defval);
     }
 
     for (i = 0; i < 8; i++) {
@@ -177,13 +215,23 @@ void config_read(void)
     }
 
     memset(configtxt, 0, sizeof(configtxt));
-    snprintf(configtxt, sizeof(configtxt) - 1 , config_template,
+    int len = snprintf(configtxt, sizeof(configtxt) - 1 , config_template,
              config.wifi_ssid,
              config.smb2_user, config.smb2_workgroup, config.smb2_server,
              config.hds[0],
              config.hds[1],
              config.hds[2],
              config.hds[3],
+             config.hdswback[0],
+             config.hdswback[1],
+             config.hdswback[2],
+             config.hdswback[3],
+             config.hdscache[0],
+             config.hdscache[1],
+             config.hdscache[2],
+             config.hdscache[3],
+             config.hdsprefetch,
+             config.cachekb,
              config.remoteboot, config.remoteunit,
              config.remote[0],
              config.remote[1],
@@ -196,6 +244,8 @@ void config_read(void)
              config.tz,
              config.tadjust,
              config.fastconnect);
+    if (len >= sizeof(configtxt) - 1)
+        printf("config.txt is truncated (%d bytes)\n", len);
 
     for (i = 0; i < 8; i++) {
         for (char *p = config.remote[i]; *p != '\0'; p++) {
@@ -211,6 +261,34 @@ void config_read(void)
     }
 }
 
+/*
+ * Erase and program the flash. The other core may be running from XIP
+ * (the USB task), so it is locked out by flash_safe_execute().
+ */
+struct flash_op {
+    uint32_t offset;
+    size_t erase;
+    const uint8_t *data;
+    size_t size;
+};
+
+static void flash_op_exec(void *param)
+{
+    const struct flash_op *op = param;
+    flash_range_erase(op->offset, op->erase);
+    if (op->size > 0)
+        flash_range_program(op->offset, op->data, op->size);
+}
+
+static int flash_update(uint32_t offset, size_t erase, const uint8_t *data, size_t size)
+{
+    struct flash_op op = { .offset = offset, .erase = erase, .data = data, .size = size };
+    int res = flash_safe_execute(flash_op_exec, &op, UINT32_MAX);
+    if (res != PICO_OK)
+        printf("Flash update failure (%d)\n", res);
+    return res;
+}
+
 void config_write(void)
 {
     uint8_t flash_data[SECTOR_SIZE * 4];
@@ -222,17 +300,35 @@ void config_write(void)
         p += c->valuesz;
     }
 
-    uint32_t stat = save_and_disable_interrupts();
-    flash_range_erase(CONFIG_FLASH_OFFSET, FLASH_SECTOR_SIZE * 4);
-    flash_range_program(CONFIG_FLASH_OFFSET, flash_data, sizeof(flash_data));
-    restore_interrupts(stat);
+    flash_update(CONFIG_FLASH_OFFSET, FLASH_SECTOR_SIZE * 4, flash_data, sizeof(flash_data));
 }
 
 void config_erase(void)
 {
-    uint32_t stat = save_and_disable_interrupts();
-    flash_range_erase(CONFIG_FLASH_OFFSET, FLASH_SECTOR_SIZE * 4);
-    restore_interrupts(stat);
+    flash_update(CONFIG_FLASH_OFFSET, FLASH_SECTOR_SIZE * 4, NULL, 0);
+}
+
+//****************************************************************************
+// HDS boot profile
+//****************************************************************************
+
+#define BOOTPROF_FLASH_OFFSET   (CONFIG_FLASH_OFFSET + FLASH_SECTOR_SIZE * 4)
+#define BOOTPROF_FLASH_ADDR     ((uint8_t *)(0x10000000 + BOOTPROF_FLASH_OFFSET))
+#define BOOTPROF_FLASH_MAGIC    "X68000Z Remote Drive Profile v1"
+
+const uint8_t *bootprof_read(void)
+{
+    if (memcmp(BOOTPROF_FLASH_ADDR, BOOTPROF_FLASH_MAGIC, sizeof(BOOTPROF_FLASH_MAGIC)) != 0)
+        return NULL;
+    return BOOTPROF_FLASH_ADDR;
+}
+
+void bootprof_write(uint8_t *data, size_t size)
+{
+    memcpy(&data[0], BOOTPROF_FLASH_MAGIC, sizeof(BOOTPROF_FLASH_MAGIC));
+    size = (size + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+
+    flash_update(BOOTPROF_FLASH_OFFSET, FLASH_SECTOR_SIZE, data, size);
 }
 
 void config_parse(uint8_t *buf)
@@ -31,7 +31,10 @@
 
 /* configuration data */
 
-extern char configtxt[2048];
+/* config.tmpl.txt expanded with all the items at their maximum length fits */
+#define CONFIGTXT_SIZE  4096
+
+extern char configtxt[CONFIGTXT_SIZE];
 extern struct config_data config;
 
 /* configuration functions */
@@ -41,4 +44,11 @@ void config_write(void);
 void config_erase(void);
 void config_parse(uint8_t *buf);
 
+/* HDS boot profile (the first 32 bytes of the data are used for the header) */
+
+#define BOOTPROF_SIZE   2048
+
+const uint8_t *bootprof_read(void);
+void bootprof_write(uint8_t *data, size_t size);
+
 #endif  /* _CONFIG_FILE_H */
@@ -147,6 +147,10 @@ static int vd_mount(void)
         printf("REMOTE%u: %s\n", i, config.remote[i]);
     }
 
+    /* Load HUMAN.SYS of REMOTE0 for remote boot */
+    if (remoteboot)
+        vd_human_load();
+
     int id = remoteboot ? 1 : 0;
 
     /* Set up remote HDS */
@@ -167,6 +171,9 @@ static int vd_mount(void)
         }
         diskinfo[id].smb2 = smb2;
         diskinfo[id].size = st.smb2_size;
+        diskinfo[id].writeback = atoi(config.hdswback[i]);
+        hds_cache_quota(&diskinfo[id], atoi(config.hdscache[i]));
+        diskinfo[id].fatprefetch = atoi(config.hdsprefetch);
         printf("HDS%u: %s size=%lld\n", i, config.hds[i], st.smb2_size);
     }
 
@@ -174,6 +181,13 @@ static int vd_mount(void)
         diskinfo[i].sects = (diskinfo[i].size + SECTOR_SIZE - 1) / SECTOR_SIZE;
     }
 
+    /* Load the boot and partition metadata of HDS into the cache */
+    for (int i = 0; i < 7; i++) {
+        if (diskinfo[i].type == DTYPE_HDS && diskinfo[i].sfh != NULL)
+            hds_cache_pin(&diskinfo[i]);
+    }
+    hds_cache_warmup();
+
     sysstatus = STAT_CONFIGURED;
 }
 
@@ -191,7 +205,7 @@ void connect_task(void *params)
         vd_mount();
     }
     xSemaphoreGive(remote_sem);
-    xTaskNotify(main_th, 1, eSetBits);
+    vd_connected();
 
     while (1) {
         uint32_t nvalue;
@@ -227,6 +241,9 @@ void keepalive_task(void *params)
         struct mallinfo mi = mallinfo();
         printf("arena=%d used=%d free=%d", mi.arena, mi.uordblks, mi.fordblks);
         printf(" heapfree=%d\n", &__HeapLimit - (char *)sbrk(0));
+        static char statbuf[1024];
+        hds_cache_stat(statbuf, sizeof(statbuf));
+        printf("%s", statbuf);
 
         time_t tt = (time_t)((boottime + to_us_since_boot(get_absolute_time())) / 1000000);
         struct tm *tm = localtime(&tt);
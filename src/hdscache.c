@@ -24,17 +24,31 @@
  */
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "pico/stdlib.h"
 
 #include "smb2.h"
 #include "libsmb2.h"
 
+typedef unsigned int nfds_t;
+struct pollfd
+{
+  int fd;
+  short events;
+  short revents;
+};
+int lwip_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
 #include "main.h"
 #include "virtual_disk.h"
+#include "vd_command.h"
+#include "config_file.h"
 
 //****************************************************************************
 // Static variables
@@ -42,72 +56,1459 @@
 
 #define DISK_CACHE_SECTS    8
 #define DISK_CACHE_SIZE     (DISK_CACHE_SECTS * SECTOR_SIZE)
-#define DISK_CACHE_SETS     4
+
+#define DISK_CACHE_HASH     64      // must be power of 2
+
+/* readahead window (in sectors) grows while the access is sequential */
+static const int ra_window[] = { DISK_CACHE_SECTS, DISK_CACHE_SECTS * 2, DISK_CACHE_SECTS * 8 };
+
+/* write-back flush timing */
+#define FLUSH_IDLE_MS       200     // flush when no write came for this period
+#define FLUSH_MAXAGE_MS     2000    // flush when the oldest dirty data gets this old
+#define FLUSH_MAXLINES      (cache_lines / 2)
+#define FLUSH_RETRY_MS      1000    // first retry after a failed write-back
+#define FLUSH_RETRY_MAX_MS  30000   // the retry interval doubles up to this
+
+/* lines always left for the shared pool regardless of the per-unit quotas */
+#define CACHE_SHARED_MIN    (cache_lines / 4)
+/* lines which may be pinned for the disk metadata */
+#define CACHE_PIN_MAX       (cache_lines / 2)
+/* lines the arena is sized for at least -- cache_ra_lines() clamps the readahead to fit */
+#define CACHE_LINES_MIN     4
 
 static struct cache {
+    struct cache *hnext;            // hash chain
+    struct cache *prev;             // LRU list (prev is more recently used)
+    struct cache *next;
+    struct diskinfo *di;
+    uint32_t lba;                   // first sector (aligned to DISK_CACHE_SECTS)
+    uint8_t busy;                   // read in flight
+    uint8_t ramark;                 // start next readahead when this line is read
+    uint8_t pinned;                 // never evicted
+    uint8_t pfmark;                 // replay more of the boot profile when this line is read
+    uint32_t issued;                // time when the request was issued (us)
+    uint8_t valid;                  // valid sector bitmap
+    uint8_t dirty;                  // dirty sector bitmap
+    uint8_t flushing;               // sectors being written back
+    uint8_t error;                  // write-back error (the line is kept dirty)
     uint8_t data[DISK_CACHE_SIZE];
-    struct smb2_context *smb2;
-    struct smb2fh *sfh;
-    uint32_t lba;
-    size_t sects;
-} cache[DISK_CACHE_SETS];
-static int cache_next = 0;
+} *cache;                           // allocated from the cache arena
+static int cache_lines;
+static struct cache *cache_hash[DISK_CACHE_HASH];
+static struct cache cache_lru;      // LRU list head
+
+static int cache_dirty;             // number of dirty lines
+static TickType_t cache_dirty_time; // time when the first line got dirty
+static TickType_t cache_write_time; // time of the last write
+static TickType_t cache_retry_time; // time when the write-back failed
+static int cache_retry_ms;          // retry interval (0 if the last write-back succeeded)
+
+/*
+ * A run of dirty sectors continuing over adjacent lines is copied into the
+ * staging buffer and written with one request.
+ */
+#define FLUSH_RUN_SECTS     (DISK_CACHE_SECTS * 2)
+#define FLUSH_RUNS          (FLUSH_RUN_SECTS / 2)   // a run spanning lines has 2 sectors at least
+
+static uint8_t *cache_wbuf;         // staging buffer (NULL if not allocated)
+static int cache_wbuf_used;         // sectors used by the runs in flight
+static struct cache_run {
+    struct diskinfo *di;
+    uint32_t lba;                   // first sector
+    int sects;
+    uint32_t issued;                // time when the request was issued (us)
+} cache_run[FLUSH_RUNS];
+static int cache_nruns;
+
+/* Human68k partition in the HDS image */
+struct cache_part {
+    uint32_t fat;                   // first sector of the FAT
+    uint32_t data;                  // first sector of cluster #2
+    uint32_t nclust;                // number of clusters + 2
+    uint16_t clsects;               // sectors per cluster
+    uint8_t fat16;                  // 16bit FAT (12bit if 0)
+};
+
+/*
+ * Each unit may reserve some lines for itself (quota). The lines which are
+ * not reserved form a shared pool used by all units. A line owned by a unit
+ * is only reused for another unit while the owner holds more than its quota,
+ * so a bulk access to one unit cannot evict the reserved lines of the others.
+ */
+static struct cache_unit {
+    int quota;                      // reserved lines
+    int lines;                      // lines currently owned (except pinned)
+    int pinned;                     // pinned lines
+    struct cache_part part[4];      // Human68k partitions for the FAT aware prefetch
+    int nparts;
+    int chain_part;                 // partition of the chain being prefetched
+    uint32_t chain_next;            // next cluster of the chain to prefetch (0: none)
+    struct cache_stat {
+        uint32_t hit;
+        uint32_t miss;
+        uint32_t evict;
+        uint32_t fetch;
+        uint32_t flush;
+        uint32_t rsects;            // sectors read by the host
+        uint32_t wsects;            // sectors written by the host
+    } stat;
+} cache_unit[countof(diskinfo)];
+static int cache_shared;                        // lines not reserved by any unit
+static int cache_pinned;                        // pinned lines of all units
+
+static struct iostat cache_smb_read;            // SMB2 read requests
+static struct iostat cache_smb_write;           // SMB2 write requests
+
+/*
+ * Boot profile: the lines read from the HDS units during BOOTPROF_MS after
+ * the mount, as an ordered extent list. It is saved in the flash and read
+ * ahead on the next boot.
+ */
+#define BOOTPROF_MS         30000   // recording period
+#define BOOTPROF_QUIET_MS   1000    // save when no read came for this period
+#define BOOTPROF_CHANGE     8       // save when 1/BOOTPROF_CHANGE of the lines differ
+#define BOOTPROF_EXTS       ((BOOTPROF_SIZE - 32 - 4 * countof(diskinfo) - 4) / sizeof(struct bootprof_ext))
+
+struct bootprof_ext {
+    uint32_t lba;                   // first sector (aligned to DISK_CACHE_SECTS)
+    uint16_t lines;
+    uint8_t unit;
+    uint8_t reserved;
+};
+
+static struct bootprof {
+    char header[32];                // used by config_file.c
+    uint32_t size[countof(diskinfo)];   // image size of each unit when recorded
+    uint16_t nexts;
+    uint16_t reserved;
+    struct bootprof_ext ext[];
+} *bootprof_rec;                    // being recorded
+
+static uint32_t bootprof_buf[BOOTPROF_SIZE / sizeof(uint32_t)];
+static const struct bootprof *bootprof_flash;   // being replayed
+static bool bootprof_recording;
+static TickType_t bootprof_start;   // time when the recording started
+static TickType_t bootprof_last;    // time of the last recorded read
+static uint32_t bootprof_line[countof(diskinfo)];   // last line read
+static int bootprof_tail[countof(diskinfo)];        // last extent of the unit
+static int bootprof_pos;            // next extent to replay
+static int bootprof_off;            // lines of the extent already replayed
+
+#define UNIT(di)            (&cache_unit[(di) - diskinfo])
 
 //****************************************************************************
-// HDS Disk cache
+// Private functions
 //****************************************************************************
 
-void hds_cache_init(void)
+#define SECT_BIT(c, lba)    (1 << ((lba) - (c)->lba))
+#define SECT_BITS(c, lba, n) (((1 << (n)) - 1) << ((lba) - (c)->lba))
+#define SECT_PTR(c, lba)    (&(c)->data[((lba) - (c)->lba) * SECTOR_SIZE])
+
+static inline int cache_hashno(struct diskinfo *di, uint32_t lba)
 {
-    for (int i = 0; i < DISK_CACHE_SETS; i++) {
-        cache[i].sfh = NULL;
-        cache[i].lba = 0xffffffff;
-        cache[i].sects = 0;
+    uint32_t h = (uint32_t)(uintptr_t)di ^ (lba / DISK_CACHE_SECTS);
+    h *= 0x9e3779b1u;
+    return h >> 26;                 // top 6 bits -> 0 .. DISK_CACHE_HASH - 1
+}
+
+static void cache_lru_unlink(struct cache *c)
+{
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+}
+
+static void cache_lru_head(struct cache *c)
+{
+    c->prev = &cache_lru;
+    c->next = cache_lru.next;
+    cache_lru.next->prev = c;
+    cache_lru.next = c;
+}
+
+static void cache_lru_tail(struct cache *c)
+{
+    c->prev = cache_lru.prev;
+    c->next = &cache_lru;
+    cache_lru.prev->next = c;
+    cache_lru.prev = c;
+}
+
+static void cache_hash_unlink(struct cache *c)
+{
+    struct cache **p = &cache_hash[cache_hashno(c->di, c->lba)];
+    for (; *p != NULL; p = &(*p)->hnext) {
+        if (*p == c) {
+            *p = c->hnext;
+            break;
+        }
     }
+    c->hnext = NULL;
 }
 
-int hds_cache_read(struct smb2_context *smb2, struct smb2fh *sfh, uint32_t lba, uint8_t *buf)
+/* Look up the line without changing the LRU order */
+static struct cache *cache_lookup(struct diskinfo *di, uint32_t lba)
 {
-    for (int i = 0; i < DISK_CACHE_SETS; i++) {
+    lba -= lba % DISK_CACHE_SECTS;
+    for (struct cache *c = cache_hash[cache_hashno(di, lba)]; c != NULL; c = c->hnext) {
+        if (c->di == di && c->lba == lba)
+            return c;
+    }
+    return NULL;
+}
+
+static struct cache *cache_find(struct diskinfo *di, uint32_t lba)
+{
+    struct cache *c = cache_lookup(di, lba);
+    if (c != NULL) {
+        cache_lru_unlink(c);
+        cache_lru_head(c);
+    }
+    return c;
+}
+
+static void cache_unpin(struct cache *c)
+{
+    c->pinned = 0;
+    UNIT(c->di)->pinned--;
+    UNIT(c->di)->lines++;
+    cache_pinned--;
+    cache_shared++;
+}
+
+static void cache_discard(struct cache *c)
+{
+    if (c->pinned)
+        cache_unpin(c);
+    if (c->di != NULL) {
+        cache_hash_unlink(c);
+        UNIT(c->di)->lines--;
+    }
+    if (c->dirty)
+        cache_dirty--;
+    c->di = NULL;
+    c->valid = c->dirty = 0;
+    cache_lru_unlink(c);
+    cache_lru_tail(c);                  // reused first
+}
+
+/* Abandon all requests in flight after the connection failed */
+static void cache_abort(struct diskinfo *di)
+{
+    for (int i = 0; i < cache_lines; i++) {
         struct cache *c = &cache[i];
-        if (c->sfh == sfh && c->smb2 == smb2 && lba >= c->lba && lba < c->lba + c->sects) {
-            memcpy(buf, &c->data[(lba - c->lba) * SECTOR_SIZE], SECTOR_SIZE);
-            return 0;
+        if (c->di == di && c->busy) {
+            c->busy = 0;
+            cache_discard(c);
         }
+        if (c->di == di && c->flushing)
+            c->error = 1;           // the write may not have reached the server
     }
+    di->pending = 0;
+}
 
-    struct cache *c = &cache[cache_next];
-    uint64_t cur;
-    if (smb2_lseek(smb2, sfh, lba * SECTOR_SIZE, SEEK_SET, &cur) < 0)
+/* Process replies from the server, waiting up to timeout ms */
+static int cache_service(struct diskinfo *di, int timeout)
+{
+    struct pollfd pfd;
+
+    pfd.fd = smb2_get_fd(di->smb2);
+    pfd.events = smb2_which_events(di->smb2);
+
+    if (lwip_poll(&pfd, 1, timeout) < 0 ||
+        (pfd.revents != 0 && smb2_service(di->smb2, pfd.revents) < 0)) {
+        cache_abort(di);
         return -1;
-    c->sects = 0;
-    int sz = smb2_read(smb2, sfh, c->data, DISK_CACHE_SIZE);
-    if (sz < 0)
+    }
+    return 0;
+}
+
+/* Wait for all requests of the disk */
+static int cache_wait(struct diskinfo *di)
+{
+    while (di->pending > 0) {
+        if (cache_service(di, 1000) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Wait for the read of the line */
+static int cache_wait_line(struct cache *c)
+{
+    struct diskinfo *di = c->di;
+    while (c->busy) {
+        if (cache_service(di, 1000) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// Write-back
+//----------------------------------------------------------------------------
+
+static void cache_flush_cb(struct smb2_context *smb2, int status,
+                           void *command_data, void *private_data)
+{
+    struct cache *c = private_data;
+
+    iostat_add(&cache_smb_write, c->issued);
+    c->di->pending--;
+    if (status < 0)
+        c->error = 1;
+}
+
+/* Mark the error on the lines written by the run */
+static void cache_run_error(struct cache_run *r)
+{
+    uint32_t lba = r->lba - r->lba % DISK_CACHE_SECTS;
+    for (; lba < r->lba + r->sects; lba += DISK_CACHE_SECTS) {
+        struct cache *c = cache_lookup(r->di, lba);
+        if (c != NULL)
+            c->error = 1;
+    }
+}
+
+static void cache_run_cb(struct smb2_context *smb2, int status,
+                         void *command_data, void *private_data)
+{
+    struct cache_run *r = private_data;
+
+    iostat_add(&cache_smb_write, r->issued);
+    r->di->pending--;
+    if (status < 0)
+        cache_run_error(r);
+}
+
+static void cache_flush_mark(struct cache *c, uint8_t bits)
+{
+    if (!c->flushing)
+        c->error = 0;
+    c->flushing |= bits;
+}
+
+/* Number of dirty sectors continuing the run from the end of the line into the next lines */
+static int cache_run_follow(struct cache *c, int max)
+{
+    int sects = 0;
+    while (sects < max &&
+           (c = cache_lookup(c->di, c->lba + DISK_CACHE_SECTS)) != NULL) {
+        uint8_t todo = c->dirty & ~c->flushing;
+        int n = 0;
+        while (n < DISK_CACHE_SECTS && (todo & (1 << n)))
+            n++;
+        sects += n;
+        if (n < DISK_CACHE_SECTS)
+            break;
+    }
+    return sects < max ? sects : max;
+}
+
+/* Write a run of dirty sectors spanning the lines from c with one request */
+static int cache_run_issue(struct cache *c, uint32_t lba, int sects)
+{
+    struct diskinfo *di = c->di;
+
+    if (cache_wbuf_used + sects > FLUSH_RUN_SECTS || cache_nruns >= FLUSH_RUNS) {
+        /* the staging buffer is full -- wait for the runs in flight */
+        if (cache_wait(di) < 0)
+            return -1;
+        cache_wbuf_used = cache_nruns = 0;
+    }
+
+    struct cache_run *r = &cache_run[cache_nruns++];
+    uint8_t *buf = &cache_wbuf[cache_wbuf_used * SECTOR_SIZE];
+    uint8_t *p = buf;
+    r->di = di;
+    r->lba = lba;
+    r->sects = sects;
+    r->issued = time_us_32();
+    for (int left = sects; left > 0; ) {
+        int i = lba - c->lba;
+        int n = DISK_CACHE_SECTS - i < left ? DISK_CACHE_SECTS - i : left;
+        memcpy(p, &c->data[i * SECTOR_SIZE], n * SECTOR_SIZE);
+        cache_flush_mark(c, ((1 << n) - 1) << i);
+        p += n * SECTOR_SIZE;
+        lba += n;
+        left -= n;
+        if (left > 0)
+            c = cache_lookup(di, lba);
+    }
+    if (smb2_pwrite_async(di->smb2, di->sfh, buf, sects * SECTOR_SIZE,
+                          (uint64_t)r->lba * SECTOR_SIZE, cache_run_cb, r) < 0) {
+        cache_run_error(r);
         return -1;
-    c->sfh = sfh;
-    c->smb2 = smb2;
-    c->lba = lba;
-    c->sects = sz / SECTOR_SIZE;
-    cache_next =(cache_next + 1) % DISK_CACHE_SETS;
-    memcpy(buf, c->data, SECTOR_SIZE);
+    }
+    cache_wbuf_used += sects;
     return 0;
 }
 
-int hds_cache_write(struct smb2_context *smb2, struct smb2fh *sfh, uint32_t lba, uint8_t *buf)
+/*
+ * Issue one write for each run of adjacent dirty sectors in the line which is
+ * not being written yet. A run reaching the end of the line is continued into
+ * the following dirty lines and written through the staging buffer.
+ * The dirty bits are cleared by cache_flush_done() after the writes complete.
+ */
+static int cache_flush_issue(struct cache *c)
 {
-    for (int i = 0; i < DISK_CACHE_SETS; i++) {
+    struct diskinfo *di = c->di;
+
+    for (int i = 0; i < DISK_CACHE_SECTS; ) {
+        uint8_t todo = c->dirty & ~c->flushing;
+        if (!(todo & (1 << i))) {
+            i++;
+            continue;
+        }
+        int n = 1;
+        while (i + n < DISK_CACHE_SECTS && (todo & (1 << (i + n))))
+            n++;
+        int sects = n;
+        if (i + n == DISK_CACHE_SECTS && cache_wbuf != NULL)
+            sects += cache_run_follow(c, FLUSH_RUN_SECTS - n);
+        if (sects > n) {
+            if (cache_run_issue(c, c->lba + i, sects) < 0)
+                return -1;
+        } else {
+            cache_flush_mark(c, ((1 << n) - 1) << i);
+            c->issued = time_us_32();
+            if (smb2_pwrite_async(di->smb2, di->sfh, &c->data[i * SECTOR_SIZE], n * SECTOR_SIZE,
+                                  (uint64_t)(c->lba + i) * SECTOR_SIZE, cache_flush_cb, c) < 0) {
+                c->error = 1;
+                return -1;
+            }
+        }
+        di->pending++;
+        UNIT(di)->stat.flush++;
+        i += n;
+    }
+    return 0;
+}
+
+static int cache_flush_done(struct cache *c)
+{
+    uint8_t written = c->flushing;
+
+    c->flushing = 0;
+    if (c->error)
+        return -1;
+    c->dirty &= ~written;
+    if (!c->dirty)
+        cache_dirty--;
+    return 0;
+}
+
+/* Wait for the writes issued for the disk and clear the dirty bits written */
+static int cache_flush_finish(struct diskinfo *di, int res)
+{
+    if (cache_wait(di) < 0)
+        res = -1;
+    cache_wbuf_used = cache_nruns = 0;
+    for (int i = 0; i < cache_lines; i++) {
+        struct cache *c = &cache[i];
+        if (c->di == di && c->flushing && cache_flush_done(c) < 0)
+            res = -1;
+    }
+    return res;
+}
+
+/* Dirty line of the disk with the lowest LBA from lba */
+static struct cache *cache_next_dirty(struct diskinfo *di, uint32_t lba)
+{
+    struct cache *next = NULL;
+
+    for (int i = 0; i < cache_lines; i++) {
         struct cache *c = &cache[i];
-        if (c->sfh == sfh && c->smb2 == smb2 && lba >= c->lba && lba < c->lba + c->sects) {
-            memcpy(&c->data[(lba - c->lba) * SECTOR_SIZE], buf, SECTOR_SIZE);
+        if (c->di == di && (c->dirty & ~c->flushing) && c->lba >= lba &&
+            (next == NULL || c->lba < next->lba))
+            next = c;
+    }
+    return next;
+}
+
+/* Write back all dirty lines of the disk in LBA order, so that adjacent lines are merged */
+static int cache_flush_disk(struct diskinfo *di)
+{
+    int res = 0;
+    struct cache *c;
+    uint32_t lba = 0;
+
+    while ((c = cache_next_dirty(di, lba)) != NULL) {
+        if (cache_flush_issue(c) < 0) {
+            res = -1;
             break;
         }
+        lba = c->lba + DISK_CACHE_SECTS;
     }
+    return cache_flush_finish(di, res);
+}
 
-    uint64_t cur;
-    if (smb2_lseek(smb2, sfh, lba * SECTOR_SIZE, SEEK_SET, &cur) < 0)
+/* Write back the line together with the dirty run it is a part of */
+static int cache_flush_line(struct cache *c)
+{
+    struct cache *first = c;
+    struct cache *p;
+
+    /* find the line where the run starts */
+    for (int n = 1; n < FLUSH_RUN_SECTS / DISK_CACHE_SECTS; n++) {
+        if (cache_wbuf == NULL || !(first->dirty & 1) || first->lba < DISK_CACHE_SECTS)
+            break;
+        p = cache_lookup(c->di, first->lba - DISK_CACHE_SECTS);
+        if (p == NULL || !(p->dirty & (1 << (DISK_CACHE_SECTS - 1))))
+            break;
+        first = p;
+    }
+
+    int res = 0;
+    if (first != c && cache_flush_issue(first) < 0)
+        res = -1;
+    if (res == 0 && cache_flush_issue(c) < 0)
+        res = -1;
+    return cache_flush_finish(c->di, res);
+}
+
+/* Is the write-back held off after a failure? */
+static bool cache_flush_backoff(void)
+{
+    return cache_retry_ms > 0 &&
+           xTaskGetTickCount() - cache_retry_time < pdMS_TO_TICKS(cache_retry_ms);
+}
+
+/* Double the retry interval on a failure, and reset it on a success */
+static int cache_flush_result(int res)
+{
+    if (res < 0) {
+        cache_retry_ms = cache_retry_ms == 0 ? FLUSH_RETRY_MS : cache_retry_ms * 2;
+        if (cache_retry_ms > FLUSH_RETRY_MAX_MS)
+            cache_retry_ms = FLUSH_RETRY_MAX_MS;
+        cache_retry_time = xTaskGetTickCount();
+        printf("HDS write-back failed (%d lines dirty), retry in %dms\n", cache_dirty, cache_retry_ms);
+    } else {
+        cache_retry_ms = 0;
+    }
+    return res;
+}
+
+//----------------------------------------------------------------------------
+// Read
+//----------------------------------------------------------------------------
+
+/* Can the line be reused for the unit? */
+static bool cache_reusable(struct cache *c, struct diskinfo *di)
+{
+    if (c->busy || c->pinned)           // lines being read cannot be reused
+        return false;
+    if (c->di == NULL || c->di == di)
+        return true;
+    return UNIT(c->di)->lines > UNIT(c->di)->quota;
+}
+
+static struct cache *cache_alloc(struct diskinfo *di, uint32_t lba)
+{
+    struct cache *c;
+
+    /*
+     * Take the least recently used line. Dirty lines which failed to be written
+     * back are left for the retry, and so are all dirty lines while backing off.
+     */
+    for (c = cache_lru.prev; c != &cache_lru; c = c->prev) {
+        if (!cache_reusable(c, di))
+            continue;
+        if (!c->dirty)
+            break;
+        if (c->error || cache_flush_backoff())
+            continue;
+        if (cache_flush_result(cache_flush_line(c)) == 0)
+            break;
+    }
+    if (c == &cache_lru)
+        return NULL;
+    if (c->di != NULL) {
+        cache_hash_unlink(c);
+        UNIT(c->di)->lines--;
+        UNIT(c->di)->stat.evict++;
+    }
+    UNIT(di)->lines++;
+    c->di = di;
+    c->lba = lba - lba % DISK_CACHE_SECTS;
+    c->valid = c->dirty = 0;
+    c->ramark = c->pfmark = 0;
+    c->error = 0;
+    cache_lru_unlink(c);
+    cache_lru_head(c);
+
+    int h = cache_hashno(c->di, c->lba);
+    c->hnext = cache_hash[h];
+    cache_hash[h] = c;
+    return c;
+}
+
+/* Allocate a line, waiting for the reads in flight if all candidates are busy */
+static struct cache *cache_alloc_wait(struct diskinfo *di, uint32_t lba)
+{
+    struct cache *c = cache_alloc(di, lba);
+
+    if (c == NULL) {
+        for (int i = 0; i < countof(diskinfo); i++) {
+            if (diskinfo[i].pending > 0)
+                cache_wait(&diskinfo[i]);
+        }
+        c = cache_alloc(di, lba);
+    }
+    return c;
+}
+
+static void cache_fetch_cb(struct smb2_context *smb2, int status,
+                           void *command_data, void *private_data)
+{
+    struct cache *c = private_data;
+
+    if (!c->busy)
+        return;                         // already abandoned
+    iostat_add(&cache_smb_read, c->issued);
+    c->busy = 0;
+    c->di->pending--;
+    if (status < 0) {
+        cache_discard(c);
+        return;
+    }
+    memset(&c->data[status], 0, DISK_CACHE_SIZE - status);
+    c->valid = (1 << ((status + SECTOR_SIZE - 1) / SECTOR_SIZE)) - 1;
+}
+
+/* The readahead may use up to half of the lines available to the unit */
+static int cache_ra_lines(struct diskinfo *di)
+{
+    int lines = (UNIT(di)->quota + cache_shared) / 2;
+    return lines < 1 ? 1 : lines;
+}
+
+/*
+ * Start reading the lines covering sects sectors from lba with pipelined
+ * async reads. Lines already in the cache are not read again.
+ * If need is set, the first line must become readable: a partially valid
+ * line is read again and the allocation waits for the lines in flight.
+ * The line containing the mark sector triggers the next readahead when read.
+ * The reads complete while later requests are processed; cache_wait_line()
+ * waits for a specific line.
+ */
+static int cache_fetch_lines(struct diskinfo *di, uint32_t lba, int sects, bool need,
+                             uint32_t mark)
+{
+    uint32_t end = lba + sects;
+    if (end > di->sects)
+        end = di->sects;
+
+    for (lba -= lba % DISK_CACHE_SECTS; lba < end; lba += DISK_CACHE_SECTS, need = false) {
+        struct cache *c = cache_find(di, lba);
+        if (c != NULL) {
+            if (c->busy || c->valid == (1 << DISK_CACHE_SECTS) - 1 || !need)
+                continue;
+            /* partially valid line: write back and read the whole line again */
+            if (c->dirty && cache_flush_line(c) < 0)
+                return -1;
+        } else if ((c = (need ? cache_alloc_wait(di, lba)
+                              : cache_alloc(di, lba))) == NULL) {
+            break;
+        }
+        if (smb2_pread_async(di->smb2, di->sfh, c->data, DISK_CACHE_SIZE,
+                             (uint64_t)c->lba * SECTOR_SIZE, cache_fetch_cb, c) < 0) {
+            cache_discard(c);
+            break;
+        }
+        c->busy = 1;
+        c->issued = time_us_32();
+        c->ramark = (mark - lba < DISK_CACHE_SECTS);
+        di->pending++;
+        UNIT(di)->stat.fetch++;
+    }
+    return 0;
+}
+
+/* Start reading the readahead window from lba */
+static int cache_fetch(struct diskinfo *di, uint32_t lba, int sects, bool need)
+{
+    lba -= lba % DISK_CACHE_SECTS;
+    if (sects > cache_ra_lines(di) * DISK_CACHE_SECTS)
+        sects = cache_ra_lines(di) * DISK_CACHE_SECTS;
+
+    /* reading the middle of the window triggers the next readahead */
+    uint32_t mark = sects > DISK_CACHE_SECTS ? lba + sects / 2 : ~0u;
+    if (cache_fetch_lines(di, lba, sects, need, mark) < 0)
         return -1;
-    int sz = smb2_write(smb2, sfh, buf, SECTOR_SIZE);
-    if (sz < 0)
+    di->ra_end = lba + sects;
+    UNIT(di)->chain_next = 0;
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// FAT aware prefetch
+//----------------------------------------------------------------------------
+
+/*
+ * Human68k file data is placed along FAT cluster chains. When a read comes
+ * to the first sector of a cluster out of the sequence, the rest of the chain
+ * is read ahead from the FAT of the partition in the cache (usually pinned).
+ * Contiguous clusters are merged into one extent.
+ */
+
+#define CLUST_LBA(pt, cl)   ((pt)->data + ((cl) - 2) * (pt)->clsects)
+
+/* Get the FAT entry of the cluster, or -1 if the FAT is not in the cache */
+static int32_t cache_fat_next(struct diskinfo *di, struct cache_part *pt, uint32_t cl)
+{
+    uint32_t off = pt->fat16 ? cl * 2 : cl * 3 / 2;
+    uint8_t b[2];
+
+    for (int i = 0; i < 2; i++, off++) {
+        uint32_t lba = pt->fat + off / SECTOR_SIZE;
+        struct cache *c = cache_lookup(di, lba);
+        if (c == NULL || c->busy || !(c->valid & SECT_BIT(c, lba)))
+            return -1;
+        b[i] = SECT_PTR(c, lba)[off % SECTOR_SIZE];
+    }
+
+    uint32_t next;
+    if (pt->fat16)
+        next = (b[0] << 8) | b[1];                      // big endian
+    else if (cl & 1)
+        next = (b[0] >> 4) | (b[1] << 4);
+    else
+        next = b[0] | ((b[1] & 0x0f) << 8);
+    return (next >= 2 && next < pt->nclust) ? next : 0;
+}
+
+/* Find the partition and cluster which lba starts */
+static int cache_chain_start(struct diskinfo *di, uint32_t lba, uint32_t *cl)
+{
+    struct cache_unit *u = UNIT(di);
+
+    for (int i = 0; i < u->nparts; i++) {
+        struct cache_part *pt = &u->part[i];
+        if (lba < pt->data || lba >= CLUST_LBA(pt, pt->nclust))
+            continue;
+        if ((lba - pt->data) % pt->clsects != 0)
+            return -1;
+        *cl = (lba - pt->data) / pt->clsects + 2;
+        return i;
+    }
+    return -1;
+}
+
+/* Start reading the cluster chain from cl */
+static int cache_fetch_chain(struct diskinfo *di, int part, uint32_t cl, bool need)
+{
+    struct cache_unit *u = UNIT(di);
+    struct cache_part *pt = &u->part[part];
+    int maxlines = cache_ra_lines(di);
+    int lines = 0;
+    uint32_t first = 0, last = 0;
+    bool marked = false;
+
+    while (cl != 0 && lines < maxlines) {
+        int32_t next = cache_fat_next(di, pt, cl);
+        if (first == 0)
+            first = cl;
+        last = cl;
+        cl = next < 0 ? 0 : next;
+        if (cl == last + 1 &&
+            (cl - first) * pt->clsects < (maxlines - lines) * DISK_CACHE_SECTS)
+            continue;
+
+        /* issue the extent from first to last */
+        uint32_t lba = CLUST_LBA(pt, first);
+        int sects = (last - first + 1) * pt->clsects;
+        uint32_t mark = ~0u;
+        lines += (lba + sects - 1) / DISK_CACHE_SECTS - lba / DISK_CACHE_SECTS + 1;
+        if (!marked && lines >= maxlines / 2) {
+            /* reading the middle of the chain triggers the next prefetch */
+            mark = lba + sects - 1;
+            marked = true;
+        }
+        if (cache_fetch_lines(di, lba, sects, need, mark) < 0)
+            return -1;
+        di->ra_end = lba + sects;
+        need = false;
+        first = 0;
+    }
+
+    u->chain_part = part;
+    u->chain_next = cl;
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// Pinned metadata
+//----------------------------------------------------------------------------
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Start reading the lines covering sects sectors from lba and pin them.
+ * Returns -1 when no more lines can be pinned.
+ */
+static int cache_pin(struct diskinfo *di, uint32_t lba, int sects)
+{
+    uint32_t end = lba + sects;
+    if (end > di->sects)
+        end = di->sects;
+
+    for (lba -= lba % DISK_CACHE_SECTS; lba < end; lba += DISK_CACHE_SECTS) {
+        struct cache *c = cache_find(di, lba);
+        if (c != NULL && c->pinned)
+            continue;
+        if (cache_pinned >= CACHE_PIN_MAX || cache_shared <= CACHE_SHARED_MIN)
+            return -1;
+        if (c == NULL && (c = cache_alloc(di, lba)) == NULL)
+            return -1;
+
+        /* pinned lines are taken from the shared pool */
+        c->pinned = 1;
+        UNIT(di)->lines--;
+        UNIT(di)->pinned++;
+        cache_pinned++;
+        cache_shared--;
+
+        if (c->busy || c->valid == (1 << DISK_CACHE_SECTS) - 1)
+            continue;
+        if (c->dirty && cache_flush_line(c) < 0)
+            return -1;
+        if (smb2_pread_async(di->smb2, di->sfh, c->data, DISK_CACHE_SIZE,
+                             (uint64_t)c->lba * SECTOR_SIZE, cache_fetch_cb, c) < 0) {
+            cache_discard(c);
+            return -1;
+        }
+        c->busy = 1;
+        c->issued = time_us_32();
+        di->pending++;
+        UNIT(di)->stat.fetch++;
+    }
+    return 0;
+}
+
+/* Get the pointer to a sector in the pinned lines */
+static uint8_t *cache_pinned_sect(struct diskinfo *di, uint32_t lba)
+{
+    struct cache *c = cache_find(di, lba);
+    if (c == NULL || !c->pinned || !(c->valid & SECT_BIT(c, lba)))
+        return NULL;
+    return SECT_PTR(c, lba);
+}
+
+//----------------------------------------------------------------------------
+// Boot profile
+//----------------------------------------------------------------------------
+
+static void bootprof_record(struct diskinfo *di, uint32_t lba)
+{
+    struct bootprof *bp = bootprof_rec;
+    int unit = di - diskinfo;
+    struct cache *c;
+
+    lba -= lba % DISK_CACHE_SECTS;
+    if (lba == bootprof_line[unit])
+        return;                         // same line as the last read
+    bootprof_line[unit] = lba;
+    bootprof_last = xTaskGetTickCount();
+    if ((c = cache_lookup(di, lba)) != NULL && c->pinned)
+        return;                         // always in the cache
+
+    for (int i = 0; i < bp->nexts; i++) {
+        struct bootprof_ext *e = &bp->ext[i];
+        if (e->unit == unit && lba >= e->lba && lba < e->lba + e->lines * DISK_CACHE_SECTS)
+            return;                     // already recorded
+    }
+
+    int t = bootprof_tail[unit];
+    if (t >= 0 && bp->ext[t].lba + bp->ext[t].lines * DISK_CACHE_SECTS == lba &&
+        bp->ext[t].lines < 0xffff) {
+        bp->ext[t].lines++;
+        return;
+    }
+    if (bp->nexts >= BOOTPROF_EXTS)
+        return;
+    bp->ext[bp->nexts] = (struct bootprof_ext){ .lba = lba, .lines = 1, .unit = unit };
+    bootprof_tail[unit] = bp->nexts++;
+}
+
+/* Number of the lines in the profile */
+static uint32_t bootprof_lines(const struct bootprof *bp)
+{
+    uint32_t n = 0;
+    for (int i = 0; i < bp->nexts; i++)
+        n += bp->ext[i].lines;
+    return n;
+}
+
+/* Number of the lines of a which are also in b */
+static uint32_t bootprof_common(const struct bootprof *a, const struct bootprof *b)
+{
+    uint32_t n = 0;
+    for (int i = 0; i < a->nexts; i++) {
+        const struct bootprof_ext *x = &a->ext[i];
+        for (int j = 0; j < b->nexts; j++) {
+            const struct bootprof_ext *y = &b->ext[j];
+            if (x->unit != y->unit)
+                continue;
+            uint32_t start = x->lba > y->lba ? x->lba : y->lba;
+            uint32_t xend = x->lba + x->lines * DISK_CACHE_SECTS;
+            uint32_t yend = y->lba + y->lines * DISK_CACHE_SECTS;
+            uint32_t end = xend < yend ? xend : yend;
+            if (start < end)
+                n += (end - start) / DISK_CACHE_SECTS;
+        }
+    }
+    return n;
+}
+
+/*
+ * The boot sequence varies a little on every boot. The flash sector is
+ * rewritten only when the images are changed or the lines read differ
+ * by more than 1/BOOTPROF_CHANGE, so a stable boot does not wear it.
+ */
+static bool bootprof_changed(const struct bootprof *bp, const struct bootprof *old)
+{
+    if (old == NULL)
+        return true;
+    if (memcmp(bp->size, old->size, sizeof(bp->size)) != 0)
+        return true;
+    uint32_t n = bootprof_lines(bp);
+    uint32_t o = bootprof_lines(old);
+    uint32_t cn = bootprof_common(bp, old);
+    uint32_t co = bootprof_common(old, bp);
+    if (cn > n)
+        cn = n;                         // extents may overlap
+    if (co > o)
+        co = o;
+    return (n - cn) * BOOTPROF_CHANGE > n || (o - co) * BOOTPROF_CHANGE > o;
+}
+
+static void bootprof_save(void)
+{
+    struct bootprof *bp = bootprof_rec;
+    size_t size = offsetof(struct bootprof, ext[bp->nexts]);
+
+    if (bp->nexts == 0)
+        return;
+    if (!bootprof_changed(bp, bootprof_flash))
+        return;
+    bootprof_write((uint8_t *)bp, size);
+    printf("HDS boot profile saved (%d extents)\n", bp->nexts);
+}
+
+/* Read ahead the next part of the boot profile */
+static void bootprof_replay(void)
+{
+    const struct bootprof *bp = bootprof_flash;
+    /* keep the lines read ahead but not read yet within a quarter of the shared pool */
+    int budget = cache_shared / 4;
+    int half = budget / 2;
+
+    while (bootprof_pos < bp->nexts && budget > 0) {
+        const struct bootprof_ext *e = &bp->ext[bootprof_pos];
+        struct diskinfo *di = &diskinfo[e->unit];
+        if (e->unit >= countof(diskinfo) || di->type != DTYPE_HDS ||
+            di->sfh == NULL || bp->size[e->unit] != di->size) {
+            bootprof_pos++;             // image has been changed
+            continue;
+        }
+
+        int n = e->lines - bootprof_off;
+        if (n > budget)
+            n = budget;
+        uint32_t lba = e->lba + bootprof_off * DISK_CACHE_SECTS;
+        if (cache_fetch_lines(di, lba, n * DISK_CACHE_SECTS, false, ~0u) < 0)
+            return;
+        /* reading the middle of the batch triggers the next one */
+        struct cache *c;
+        if (budget > half && budget - n <= half &&
+            (c = cache_lookup(di, lba + (budget - half - 1) * DISK_CACHE_SECTS)) != NULL)
+            c->pfmark = 1;
+
+        budget -= n;
+        if ((bootprof_off += n) >= e->lines) {
+            bootprof_pos++;
+            bootprof_off = 0;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// Cache access
+//----------------------------------------------------------------------------
+
+/*
+ * Read n sectors from lba within one line. want is the number of sectors
+ * left in the whole host transfer, which is fetched at once on a miss.
+ */
+static int cache_read_line(struct diskinfo *di, uint32_t lba, int n, uint8_t *buf, int want)
+{
+    struct cache *c;
+    bool seq = (lba == di->ra_next);
+
+    di->ra_next = lba + n;
+    if (!seq)
+        di->ra_level = 0;
+    if (bootprof_recording)
+        bootprof_record(di, lba);
+
+    if ((c = cache_find(di, lba)) != NULL && c->busy) {
+        if (cache_wait_line(c) < 0)     // line is being read ahead
+            return -1;
+    }
+    if (c != NULL && c->di == di &&
+        (c->valid & SECT_BITS(c, lba, n)) == SECT_BITS(c, lba, n)) {
+        UNIT(di)->stat.hit += n;
+        memcpy(buf, SECT_PTR(c, lba), n * SECTOR_SIZE);
+        if (c->pfmark) {
+            c->pfmark = 0;
+            bootprof_replay();
+        }
+        if (c->ramark && UNIT(di)->chain_next != 0) {
+            /* reading along the cluster chain -- prefetch the next clusters */
+            c->ramark = 0;
+            cache_fetch_chain(di, UNIT(di)->chain_part, UNIT(di)->chain_next, false);
+        } else if (c->ramark && seq) {
+            /* sequential read is going on -- start reading the next window */
+            c->ramark = 0;
+            if (di->ra_level < countof(ra_window) - 1)
+                di->ra_level++;
+            cache_fetch(di, di->ra_end, ra_window[di->ra_level], false);
+        }
+        return 0;
+    }
+
+    UNIT(di)->stat.miss += n;
+    uint32_t cl;
+    int part;
+    if (di->fatprefetch && !seq && (part = cache_chain_start(di, lba, &cl)) >= 0) {
+        if (cache_fetch_chain(di, part, cl, true) < 0)
+            return -1;
+    } else {
+        if (seq && di->ra_level < countof(ra_window) - 1)
+            di->ra_level++;
+        int sects = ra_window[di->ra_level];
+        if (sects < want)
+            sects = want;
+        if (cache_fetch(di, lba, sects, true) < 0)
+            return -1;
+    }
+
+    /* wait only for the requested line, the rest of the window arrives later */
+    if ((c = cache_find(di, lba)) == NULL || cache_wait_line(c) < 0)
+        return -1;
+    if (c->di != di || (c->valid & SECT_BITS(c, lba, n)) != SECT_BITS(c, lba, n))
+        return -1;
+    memcpy(buf, SECT_PTR(c, lba), n * SECTOR_SIZE);
+    return 0;
+}
+
+/*
+ * Check whether count sectors from lba can be read without any network
+ * access: all the lines are valid, and none of them triggers a readahead.
+ */
+static bool cache_resident(struct diskinfo *di, uint32_t lba, int count)
+{
+    while (count > 0) {
+        int n = DISK_CACHE_SECTS - lba % DISK_CACHE_SECTS;
+        if (n > count)
+            n = count;
+        struct cache *c = cache_lookup(di, lba);
+        if (c == NULL || c->busy || c->ramark || c->pfmark ||
+            (c->valid & SECT_BITS(c, lba, n)) != SECT_BITS(c, lba, n))
+            return false;
+        lba += n;
+        count -= n;
+    }
+    return true;
+}
+
+/* Read count sectors from lba line by line */
+static int cache_read(struct diskinfo *di, uint32_t lba, int count, uint8_t *buf)
+{
+    while (count > 0) {
+        int n = DISK_CACHE_SECTS - lba % DISK_CACHE_SECTS;
+        if (n > count)
+            n = count;
+        if (cache_read_line(di, lba, n, buf, count) < 0)
+            return -1;
+        lba += n;
+        buf += n * SECTOR_SIZE;
+        count -= n;
+    }
+    return 0;
+}
+
+static int cache_write(struct diskinfo *di, uint32_t lba, int count, uint8_t *buf)
+{
+    uint32_t wlba = lba;
+    uint8_t *wbuf = buf;
+
+    /* update the cached lines (allocate them in the write-back mode) */
+    for (int left = count; left > 0; ) {
+        int n = DISK_CACHE_SECTS - lba % DISK_CACHE_SECTS;
+        if (n > left)
+            n = left;
+        struct cache *c = cache_find(di, lba);
+
+        if (c != NULL && c->busy) {
+            if (cache_wait_line(c) < 0)
+                return -1;
+            if (c->di != di)
+                c = NULL;
+        }
+        if (di->writeback) {
+            if (c == NULL && (c = cache_alloc_wait(di, lba)) == NULL)
+                return -1;
+            cache_write_time = xTaskGetTickCount();
+            if (!c->dirty && cache_dirty++ == 0)
+                cache_dirty_time = cache_write_time;
+            c->dirty |= SECT_BITS(c, lba, n);
+        }
+        if (c != NULL) {
+            memcpy(SECT_PTR(c, lba), buf, n * SECTOR_SIZE);
+            c->valid |= SECT_BITS(c, lba, n);
+        }
+        lba += n;
+        buf += n * SECTOR_SIZE;
+        left -= n;
+    }
+
+    if (di->writeback) {
+        if (cache_dirty >= FLUSH_MAXLINES && !cache_flush_backoff())
+            return cache_flush_result(cache_flush_disk(di));
+        return 0;
+    }
+
+    /* write through the whole transfer at once */
+    uint64_t cur;
+    uint32_t start = time_us_32();
+    if (smb2_lseek(di->smb2, di->sfh, wlba * SECTOR_SIZE, SEEK_SET, &cur) < 0)
         return -1;
+    for (int size = count * SECTOR_SIZE; size > 0; ) {
+        int sz = smb2_write(di->smb2, di->sfh, wbuf, size);
+        if (sz <= 0) {
+            iostat_add(&cache_smb_write, start);
+            return -1;
+        }
+        wbuf += sz;
+        size -= sz;
+    }
+    iostat_add(&cache_smb_write, start);
     return 0;
 }
+
+static int cache_flush_all(void)
+{
+    int res = 0;
+
+    if (cache_dirty == 0)
+        return 0;
+    for (int i = 0; i < countof(diskinfo); i++) {
+        if (diskinfo[i].type == DTYPE_HDS && diskinfo[i].writeback &&
+            cache_flush_disk(&diskinfo[i]) < 0)
+            res = -1;
+    }
+    return res;
+}
+
+//****************************************************************************
+// HDS Disk cache
+//****************************************************************************
+
+/* Arena size needed for the cache at least */
+size_t hds_cache_min_size(void)
+{
+    return CACHE_LINES_MIN * sizeof(struct cache) + 8;     // arena_alloc() rounds up
+}
+
+void hds_cache_init(void)
+{
+    /* staging buffer for the write-back -- only when it takes up to 1/8 of the arena */
+    cache_wbuf = NULL;
+    for (int i = 0; i < countof(config.hdswback); i++) {
+        if (atoi(config.hdswback[i]) && arena_avail() >= FLUSH_RUN_SECTS * SECTOR_SIZE * 8) {
+            cache_wbuf = arena_alloc(FLUSH_RUN_SECTS * SECTOR_SIZE);
+            break;
+        }
+    }
+    cache_wbuf_used = cache_nruns = 0;
+
+    /* take all the rest of the cache arena */
+    cache_lines = (arena_avail() & ~7) / sizeof(struct cache);
+    cache = arena_alloc(cache_lines * sizeof(struct cache));
+    if (cache_lines < CACHE_LINES_MIN)
+        printf("HDS cache: only %d cache lines\n", cache_lines);
+
+    cache_lru.prev = cache_lru.next = &cache_lru;
+    for (int i = 0; i < DISK_CACHE_HASH; i++) {
+        cache_hash[i] = NULL;
+    }
+    for (int i = 0; i < cache_lines; i++) {
+        cache[i].hnext = NULL;
+        cache[i].di = NULL;
+        cache[i].lba = 0xffffffff;
+        cache[i].busy = cache[i].ramark = cache[i].pinned = cache[i].pfmark = 0;
+        cache[i].valid = cache[i].dirty = 0;
+        cache[i].flushing = cache[i].error = 0;
+        cache_lru_head(&cache[i]);
+    }
+    cache_dirty = 0;
+    cache_retry_ms = 0;
+    for (int i = 0; i < countof(cache_unit); i++) {
+        cache_unit[i].quota = cache_unit[i].lines = cache_unit[i].pinned = 0;
+        cache_unit[i].nparts = 0;
+        cache_unit[i].chain_next = 0;
+    }
+    cache_shared = cache_lines;
+    cache_pinned = 0;
+}
+
+/* Reserve kbytes of the cache for the unit */
+void hds_cache_quota(struct diskinfo *di, int kbytes)
+{
+    struct cache_unit *u = UNIT(di);
+    int lines = kbytes * 1024 / DISK_CACHE_SIZE;
+    int avail = cache_shared + u->quota - CACHE_SHARED_MIN;
+
+    if (lines < 0)
+        lines = 0;
+    if (lines > avail) {
+        printf("HDS cache: quota of unit %d is reduced to %dKB\n",
+               (int)(di - diskinfo), avail * DISK_CACHE_SIZE / 1024);
+        lines = avail;
+    }
+    cache_shared += u->quota - lines;
+    u->quota = lines;
+}
+
+/*
+ * The cache is used from the I/O worker task (and the USB task for cache
+ * hits) while async requests are in flight, and libsmb2 may call the
+ * completion callbacks from any task servicing the same smb2 context.
+ * remote_sem serializes all of them.
+ */
+
+int hds_cache_read(struct diskinfo *di, uint32_t lba, int count, uint8_t *buf)
+{
+    xSemaphoreTake(remote_sem, portMAX_DELAY);
+    UNIT(di)->stat.rsects += count;
+    int res = cache_read(di, lba, count, buf);
+    xSemaphoreGive(remote_sem);
+    return res;
+}
+
+/*
+ * Read only when the sectors are in the cache and the cache is not in use.
+ * Returns 1 without waiting if the read needs the I/O worker.
+ */
+int hds_cache_read_cached(struct diskinfo *di, uint32_t lba, int count, uint8_t *buf)
+{
+    int res = 1;
+
+    if (xSemaphoreTake(remote_sem, 0) != pdTRUE)
+        return 1;
+    if (cache_resident(di, lba, count)) {
+        UNIT(di)->stat.rsects += count;
+        res = cache_read(di, lba, count, buf);
+    }
+    xSemaphoreGive(remote_sem);
+    return res;
+}
+
+int hds_cache_write(struct diskinfo *di, uint32_t lba, int count, uint8_t *buf)
+{
+    xSemaphoreTake(remote_sem, portMAX_DELAY);
+    UNIT(di)->stat.wsects += count;
+    int res = cache_write(di, lba, count, buf);
+    xSemaphoreGive(remote_sem);
+    return res;
+}
+
+/* Write back all dirty lines */
+int hds_cache_flush(void)
+{
+    xSemaphoreTake(remote_sem, portMAX_DELAY);
+    int res = cache_flush_result(cache_flush_all());
+    xSemaphoreGive(remote_sem);
+    return res;
+}
+
+/* Called periodically from the I/O worker task */
+void hds_cache_idle(void)
+{
+    if (xSemaphoreTake(remote_sem, 0) != pdTRUE)
+        return;
+
+    /* receive readahead data that has arrived */
+    for (int i = 0; i < countof(diskinfo); i++) {
+        if (diskinfo[i].pending > 0)
+            cache_service(&diskinfo[i], 0);
+    }
+
+    TickType_t now = xTaskGetTickCount();
+    if (cache_dirty > 0 && !cache_flush_backoff() &&
+        (now - cache_write_time >= pdMS_TO_TICKS(FLUSH_IDLE_MS) ||
+         now - cache_dirty_time >= pdMS_TO_TICKS(FLUSH_MAXAGE_MS))) {
+        cache_flush_result(cache_flush_all());
+    }
+
+    if (bootprof_recording &&
+        now - bootprof_start >= pdMS_TO_TICKS(BOOTPROF_MS) &&
+        now - bootprof_last >= pdMS_TO_TICKS(BOOTPROF_QUIET_MS)) {
+        bootprof_recording = false;
+        bootprof_save();
+    }
+    xSemaphoreGive(remote_sem);
+}
+
+/*
+ * Pin the metadata read on every boot from the HDS image: the SCSI signature,
+ * boot loader, partition table and SCSI driver (0x0000-0x3fff), and the boot
+ * sector, root directory and FAT of each Human68k partition.
+ * The layout of the partitions is also kept for the FAT aware prefetch.
+ * Called right after the image is opened, with remote_sem held.
+ */
+void hds_cache_pin(struct diskinfo *di)
+{
+    struct cache_unit *u = UNIT(di);
+    uint32_t part[15], partsize[15];
+    int nparts = 0;
+    uint8_t *p;
+
+    u->nparts = 0;
+    u->chain_next = 0;
+
+    cache_pin(di, 0, 0x4000 / SECTOR_SIZE);
+    if (cache_wait(di) < 0)
+        return;
+
+    /* partition table (start and size are in 1024 byte units) */
+    if ((p = cache_pinned_sect(di, 0x800 / SECTOR_SIZE)) == NULL ||
+        memcmp(p, "X68K", 4) != 0)
+        return;
+    for (int i = 0; i < countof(part); i++) {
+        uint8_t *e = &p[16 + i * 16];
+        if (memcmp(e, "Human68k", 8) == 0) {
+            part[nparts] = (get_be32(&e[8]) & 0xffffff) * (1024 / SECTOR_SIZE);
+            partsize[nparts++] = get_be32(&e[12]) * (1024 / SECTOR_SIZE);
+        }
+    }
+
+    /* partition boot sectors */
+    for (int i = 0; i < nparts; i++) {
+        cache_pin(di, part[i], 1024 / SECTOR_SIZE);
+    }
+    if (cache_wait(di) < 0)
+        return;
+
+    struct {
+        uint32_t lba;
+        int sects;
+    } fat[countof(part)], root[countof(part)];
+    int n = 0;
+    for (int i = 0; i < nparts; i++) {
+        if ((p = cache_pinned_sect(di, part[i])) == NULL)
+            continue;
+        /* BPB */
+        int secsz = get_be16(&p[0x12]);
+        int nfats = p[0x15];
+        int rsvd = get_be16(&p[0x16]);
+        int rootents = get_be16(&p[0x18]);
+        int fatsects = p[0x1d];
+        if (secsz < SECTOR_SIZE || secsz % SECTOR_SIZE != 0 ||
+            nfats < 1 || nfats > 2 || fatsects == 0)
+            continue;
+        int k = secsz / SECTOR_SIZE;
+        fat[n].lba = part[i] + rsvd * k;
+        fat[n].sects = fatsects * k;
+        root[n].lba = fat[n].lba + nfats * fatsects * k;
+        root[n].sects = (rootents * 32 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+        /* data area layout for the FAT aware prefetch */
+        if (p[0x14] != 0 && u->nparts < countof(u->part)) {
+            struct cache_part *pt = &u->part[u->nparts++];
+            pt->fat = fat[n].lba;
+            pt->data = root[n].lba + (rootents * 32 + secsz - 1) / secsz * k;
+            pt->clsects = p[0x14] * k;
+            pt->nclust = (partsize[i] - (pt->data - part[i])) / pt->clsects + 2;
+            pt->fat16 = pt->nclust - 2 >= 4085;
+        }
+        n++;
+    }
+
+    /* root directories first, then as much of the FATs as possible */
+    int i;
+    for (i = 0; i < n; i++) {
+        if (cache_pin(di, root[i].lba, root[i].sects) < 0)
+            break;
+    }
+    for (i = 0; i < n; i++) {
+        if (cache_pin(di, fat[i].lba, fat[i].sects) < 0)
+            break;
+    }
+    cache_wait(di);
+}
+
+/*
+ * Read ahead the boot profile recorded at the last boot, and start recording
+ * a new one. Called after all HDS units are mounted, with remote_sem held.
+ */
+void hds_cache_warmup(void)
+{
+    struct bootprof *bp = bootprof_rec = (struct bootprof *)bootprof_buf;
+
+    memset(bp, 0, sizeof(bootprof_buf));
+    for (int i = 0; i < countof(diskinfo); i++) {
+        bp->size[i] = diskinfo[i].type == DTYPE_HDS ? diskinfo[i].size : 0;
+        bootprof_line[i] = ~0u;
+        bootprof_tail[i] = -1;
+    }
+    bootprof_start = bootprof_last = xTaskGetTickCount();
+    bootprof_recording = true;
+
+    bootprof_pos = bootprof_off = 0;
+    if ((bootprof_flash = (const struct bootprof *)bootprof_read()) != NULL &&
+        bootprof_flash->nexts <= BOOTPROF_EXTS) {
+        printf("HDS boot profile: %d extents\n", bootprof_flash->nexts);
+        bootprof_replay();
+    } else {
+        bootprof_flash = NULL;
+    }
+}
+
+int hds_cache_stat(char *buf, size_t size)
+{
+    size_t len = 0;
+
+#define STAT_PRINTF(...) \
+    do { if (len < size) len += snprintf(&buf[len], size - len, __VA_ARGS__); } while (0)
+
+    STAT_PRINTF("HDS cache: lines=%d (%dKB) shared=%d pinned=%d\n",
+                cache_lines, cache_lines * DISK_CACHE_SIZE / 1024, cache_shared, cache_pinned);
+    for (int i = 0; i < countof(cache_unit); i++) {
+        struct cache_unit *u = &cache_unit[i];
+        if (diskinfo[i].type != DTYPE_HDS)
+            continue;
+        uint32_t total = u->stat.hit + u->stat.miss;
+        STAT_PRINTF(" unit%d: quota=%d lines=%d pinned=%d hit=%u miss=%u evict=%u (%u%%)\n",
+                    i, u->quota, u->lines, u->pinned, u->stat.hit, u->stat.miss, u->stat.evict,
+                    total ? (uint32_t)((uint64_t)u->stat.hit * 100 / total) : 0);
+        STAT_PRINTF("        read=%" PRIu64 " write=%" PRIu64 " bytes fetch=%u flush=%u\n",
+                    (uint64_t)u->stat.rsects * SECTOR_SIZE, (uint64_t)u->stat.wsects * SECTOR_SIZE,
+                    u->stat.fetch, u->stat.flush);
+    }
+    if (len < size)
+        len += iostat_print(&buf[len], size - len, "SMB2 read", &cache_smb_read);
+    if (len < size)
+        len += iostat_print(&buf[len], size - len, "SMB2 write", &cache_smb_write);
+    return (int)(len < size ? len : size - 1);
+#undef STAT_PRINTF
+}
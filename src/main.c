@@ -24,11 +24,15 @@
  */
 
 #include <time.h>
+#include <malloc.h>
+#include <unistd.h>
 
 #include "pico/stdio.h"
 #include "pico/stdlib.h"
 #include "pico/stdio/driver.h"
 #include "pico/cyw43_arch.h"
+#include "pico/async_context_freertos.h"
+#include "lwip/opt.h"
 #include "FreeRTOS.h"
 #include "task.h"
 #include "semphr.h"
@@ -49,6 +53,7 @@ char log_txt[LOGSIZE];
 TaskHandle_t main_th;
 TaskHandle_t connect_th;
 TaskHandle_t keepalive_th;
+TaskHandle_t io_th;
 SemaphoreHandle_t remote_sem;
 
 //****************************************************************************
@@ -75,10 +80,97 @@ static void log_out_init(void)
     stdio_set_driver_enabled(&stdio_log, true);
 }
 
+//****************************************************************************
+// Cache memory arena
+//****************************************************************************
+
+/*
+ * The cache memory (HDS cache lines and the remote communication buffers)
+ * is carved from one arena allocated at startup. The arena gets all the heap
+ * headroom except CACHE_ARENA_RESERVE bytes kept for the task stacks,
+ * libsmb2 and lwIP, limited by CACHE_KB: in config.txt.
+ */
+#ifndef CACHE_ARENA_RESERVE
+#define CACHE_ARENA_RESERVE     0x10000
+#endif
+
+static uint8_t *arena_ptr;
+static size_t arena_size;
+static size_t arena_used;
+
+static void arena_init(void)
+{
+    extern char __StackLimit;
+    size_t headroom = &__StackLimit - (char *)sbrk(0);
+    size_t avail = headroom > CACHE_ARENA_RESERVE ? headroom - CACHE_ARENA_RESERVE : 0;
+    size_t limit = atoi(config.cachekb) * 1024;
+    size_t need = vd_arena_size();                      // communication buffers
+    size_t min = need + hds_cache_min_size();           // and a few cache lines
+    size_t size;
+
+    /*
+     * The reserve is kept even if it leaves the cache fewer lines than
+     * hds_cache_min_size(). Only the communication buffers may take from it.
+     */
+    size = avail;
+    if (limit > 0 && limit < size)
+        size = limit > min ? limit : min;
+    if (size > avail)
+        size = avail;
+    if (size < need) {
+        printf("Cache memory: heap headroom %uKB is too small\n", headroom / 1024);
+        size = need;
+    }
+
+    while ((arena_ptr = malloc(size)) == NULL) {
+        if (size <= need) {
+            printf("Failed to allocate cache memory\n");
+            while (1)
+                taskYIELD();
+        }
+        size = size - 0x1000 > need ? size - 0x1000 : need;
+    }
+    arena_size = size;
+    arena_used = 0;
+    printf("Cache memory: %uKB (heap headroom %uKB)\n", size / 1024, headroom / 1024);
+}
+
+void *arena_alloc(size_t size)
+{
+    size = (size + 7) & ~7;
+    if (arena_used + size > arena_size)
+        return NULL;
+    void *p = arena_ptr + arena_used;
+    arena_used += size;
+    return p;
+}
+
+size_t arena_avail(void)
+{
+    return arena_size - arena_used;
+}
+
 //****************************************************************************
 // Main task
 //****************************************************************************
 
+/*
+ * Core layout:
+ *  core 0: cyw43/lwIP, libsmb2 users (connect, keepalive) and the I/O worker
+ *  core 1: TinyUSB and the cache hit fast path in the MSC callbacks
+ * The main task starts on NET_TASK_CORE so that the cyw43 IRQ and its
+ * async context are set up there, then moves itself to USB_TASK_CORE.
+ */
+#define USB_TASK_PRIORITY       (configMAX_PRIORITIES - 2)  // just below the timer task
+#define USB_TASK_CORE           1
+#define NET_TASK_CORE           0
+
+static void pin_task(TaskHandle_t th, int core)
+{
+    if (th != NULL)
+        vTaskCoreAffinitySet(th, 1 << core);
+}
+
 static void main_task(void *params)
 {
     if (cyw43_arch_init()) {
@@ -89,21 +181,41 @@ static void main_task(void *params)
 
     cyw43_arch_enable_sta_mode();
 
+    /* tasks created by cyw43_arch_init() */
+    pin_task(((async_context_freertos_t *)cyw43_arch_async_context())->task_handle,
+             NET_TASK_CORE);
+    pin_task(xTaskGetHandle(TCPIP_THREAD_NAME), NET_TASK_CORE);
+
     remote_sem = xSemaphoreCreateBinary();
     xSemaphoreGive(remote_sem);
-    xTaskCreate(connect_task, "ConnectThread", 2048, NULL, 1, &connect_th);
-    xTaskCreate(keepalive_task, "KeepAliveThread", 2048, NULL, 1, &keepalive_th);
 
+    arena_init();
     vd_init();
 
+    if (xTaskCreateAffinitySet(vd_io_task, "IOThread", 2048, NULL, 1,
+                               1 << NET_TASK_CORE, &io_th) != pdPASS ||
+        xTaskCreateAffinitySet(connect_task, "ConnectThread", 2048, NULL, 1,
+                               1 << NET_TASK_CORE, &connect_th) != pdPASS ||
+        xTaskCreateAffinitySet(keepalive_task, "KeepAliveThread", 2048, NULL, 1,
+                               1 << NET_TASK_CORE, &keepalive_th) != pdPASS) {
+        printf("Failed to create tasks\n");
+        while (1)
+            taskYIELD();
+    }
+
     printf("Start USB MSC device.\n");
 
-    /* USB MSC main loop */
+    /*
+     * USB MSC main loop (disk I/O is done by the I/O worker task)
+     * The task runs on its own core above the network tasks, and sleeps
+     * in tud_task() until the next USB event comes.
+     */
 
-    tusb_init();
+    vTaskPrioritySet(NULL, USB_TASK_PRIORITY);
+    pin_task(main_th, USB_TASK_CORE);
+    tusb_init();                // USB IRQ is enabled on USB_TASK_CORE
     while (1) {
         tud_task();
-        taskYIELD();
     }
 }
 
@@ -118,11 +230,13 @@ void tud_mount_cb(void)
 // Invoked when device is unmounted
 void tud_umount_cb(void)
 {
+    vd_flush();
 }
 
 // Invoked when usb bus is suspended
 void tud_suspend_cb(bool remote_wakeup_en)
 {
+    vd_flush();
 }
 // Invoked when usb bus is resumed
 void tud_resume_cb(void)
@@ -142,7 +256,8 @@ int main(void)
 
     printf("\nX68000Z Remote Drive Service (version %s)\n", GIT_REPO_VERSION);
 
-    xTaskCreate(main_task, "MainThread", 2048, NULL, 1, &main_th);
+    xTaskCreateAffinitySet(main_task, "MainThread", 2048, NULL, 1,
+                           1 << NET_TASK_CORE, &main_th);
     vTaskStartScheduler();
 
     return 0;
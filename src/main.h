@@ -26,11 +26,14 @@
 #ifndef _MAIN_H_
 #define _MAIN_H_
 
+#include <stdint.h>
+#include <stdbool.h>
 #include "smb2.h"
 #include "libsmb2.h"
 #include "FreeRTOS.h"
 #include "task.h"
 #include "semphr.h"
+#include "hardware/sync.h"
 
 #define LOGSIZE         1024
 extern char log_txt[LOGSIZE];
@@ -38,6 +41,7 @@ extern char log_txt[LOGSIZE];
 extern TaskHandle_t main_th;
 extern TaskHandle_t connect_th;
 extern TaskHandle_t keepalive_th;
+extern TaskHandle_t io_th;
 extern SemaphoreHandle_t remote_sem;
 
 extern uint64_t boottime;
@@ -53,8 +57,64 @@ void disconnect_smb2_path(const char *path);
 void disconnect_smb2_all(void);
 void keepalive_smb2_all(void);
 
+void *arena_alloc(size_t size);
+size_t arena_avail(void);
+
+struct diskinfo;
+size_t hds_cache_min_size(void);
 void hds_cache_init(void);
-int hds_cache_read(struct smb2_context *smb2, struct smb2fh *sfh, uint32_t lba, uint8_t *buf);
-int hds_cache_write(struct smb2_context *smb2, struct smb2fh *sfh, uint32_t lba, uint8_t *buf);
+void hds_cache_quota(struct diskinfo *di, int kbytes);
+void hds_cache_pin(struct diskinfo *di);
+void hds_cache_warmup(void);
+int hds_cache_read(struct diskinfo *di, uint32_t lba, int count, uint8_t *buf);
+int hds_cache_read_cached(struct diskinfo *di, uint32_t lba, int count, uint8_t *buf);
+int hds_cache_write(struct diskinfo *di, uint32_t lba, int count, uint8_t *buf);
+int hds_cache_flush(void);
+void hds_cache_idle(void);
+int hds_cache_stat(char *buf, size_t size);
+
+/*
+ * Lock-free single-producer single-consumer queue of pointers, used to pass
+ * requests between the tasks on different cores. Only one task may put and
+ * only one other task may get.
+ */
+#define SPSC_SIZE       4           // must be power of 2
+struct spsc {
+    volatile uint32_t head;         // written by the producer
+    volatile uint32_t tail;         // written by the consumer
+    void *ent[SPSC_SIZE];
+};
+
+static inline bool spsc_put(struct spsc *q, void *p)
+{
+    uint32_t head = q->head;
+    if (head - q->tail >= SPSC_SIZE)
+        return false;
+    q->ent[head % SPSC_SIZE] = p;
+    __mem_fence_release();          // publish the entry (and what it points to) first
+    q->head = head + 1;
+    return true;
+}
+
+static inline void *spsc_get(struct spsc *q)
+{
+    uint32_t tail = q->tail;
+    if (tail == q->head)
+        return NULL;
+    __mem_fence_acquire();          // read the entry after seeing the head
+    void *p = q->ent[tail % SPSC_SIZE];
+    __mem_fence_release();          // release the slot after reading it
+    q->tail = tail + 1;
+    return p;
+}
+
+/* latency statistics */
+struct iostat {
+    uint32_t count;
+    uint32_t max;               // us
+    uint64_t total;             // us
+};
+void iostat_add(struct iostat *s, uint32_t start);
+int iostat_print(char *buf, size_t size, const char *name, struct iostat *s);
 
 #endif /* _MAIN_H_ */
@@ -28,12 +28,18 @@
 #include "tusb.h"
 #include "virtual_disk.h"
 
+// SCSI commands not defined by tinyusb
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10   0x35
+#define SCSI_CMD_SYNCHRONIZE_CACHE_16   0x91
+
 enum
 {
-  DISK_BLOCK_NUM  = VOLUME_SECTOR_COUNT,
   DISK_BLOCK_SIZE = SECTOR_SIZE
 };
 
+// volume size depends on the configured images
+#define DISK_BLOCK_NUM  vd_volume_sects
+
 // Invoked when received SCSI_CMD_INQUIRY
 // Application fill vendor id, product id and revision with string up to 8, 16, 4 characters respectively
 void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
@@ -92,13 +98,31 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
 
 // Callback invoked when received READ10 command.
 // Copy disk's data to buffer (up to bufsize) and return number of copied bytes.
+// lba already includes the blocks transferred so far, and bufsize is a multiple
+// of the block size (up to CFG_TUD_MSC_EP_BUFSIZE), so offset is always 0.
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize)
 {
   // out of ramdisk
   if ( lba >= DISK_BLOCK_NUM ) return -1;
 
-  vd_read_block(lba, buffer);
-  return bufsize;
+  uint32_t count = bufsize / DISK_BLOCK_SIZE;
+  if ( count > DISK_BLOCK_NUM - lba ) count = DISK_BLOCK_NUM - lba;
+  if ( count > VD_MAX_SECTS ) count = VD_MAX_SECTS;
+
+  // 0 (busy) while the I/O worker is processing the request -- called again later
+  int32_t n = vd_request(false, lba, count, buffer);
+  if ( n == VD_NOT_READY )
+  {
+    // still connecting -- the host retries after NOT READY / BECOMING READY
+    tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x01);
+    return -1;
+  }
+  if ( n == VD_IO_ERROR )
+  {
+    tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x11, 0x00);  // unrecovered read error
+    return -1;
+  }
+  return n * DISK_BLOCK_SIZE;
 }
 
 // Callback invoked when received WRITE10 command.
@@ -108,8 +132,24 @@ int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t*
   // out of ramdisk
   if ( lba >= DISK_BLOCK_NUM ) return -1;
 
-  vd_write_block(lba, buffer);
-  return bufsize;
+  uint32_t count = bufsize / DISK_BLOCK_SIZE;
+  if ( count > DISK_BLOCK_NUM - lba ) count = DISK_BLOCK_NUM - lba;
+  if ( count > VD_MAX_SECTS ) count = VD_MAX_SECTS;
+
+  // 0 (busy) while the I/O worker is processing the request -- called again later
+  int32_t n = vd_request(true, lba, count, buffer);
+  if ( n == VD_NOT_READY )
+  {
+    // still connecting -- the host retries after NOT READY / BECOMING READY
+    tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x01);
+    return -1;
+  }
+  if ( n == VD_IO_ERROR )
+  {
+    tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0c, 0x00);  // write error
+    return -1;
+  }
+  return n * DISK_BLOCK_SIZE;
 }
 
 // Callback invoked when received an SCSI command not in built-in list below
@@ -132,6 +172,19 @@ int32_t tud_msc_scsi_cb (uint8_t lun, uint8_t const scsi_cmd[16], void* buffer,
       resplen = 0;
     break;
 
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+    case SCSI_CMD_SYNCHRONIZE_CACHE_16:
+      // Write back the HDS cache before reporting the completion
+      if ( vd_flush_wait() < 0 )
+      {
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0c, 0x00);  // write error
+        resplen = -1;
+      }else
+      {
+        resplen = 0;
+      }
+    break;
+
     default:
       // Set Sense = Invalid Command Operation
       tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
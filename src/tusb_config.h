@@ -39,6 +39,11 @@
   #error CFG_TUSB_MCU must be defined
 #endif
 
+// Use the FreeRTOS queue for the device events so that tud_task() blocks
+// until an event comes (the Pico SDK defines OPT_OS_PICO, which polls)
+#undef  CFG_TUSB_OS
+#define CFG_TUSB_OS                 OPT_OS_FREERTOS
+
 // RHPort number used for device can be defined by board.mk, default to port 0
 #ifndef BOARD_DEVICE_RHPORT_NUM
   #define BOARD_DEVICE_RHPORT_NUM     0
@@ -92,7 +97,8 @@
 #define CFG_TUD_VENDOR           0
 
 // MSC Buffer size of Device Mass storage
-#define CFG_TUD_MSC_EP_BUFSIZE   512
+// (multi-sector transfers are passed to the callbacks up to this size at once)
+#define CFG_TUD_MSC_EP_BUFSIZE   16384
 
 #ifdef __cplusplus
  }
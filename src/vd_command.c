@@ -193,6 +193,10 @@ int vd_command(uint8_t *cbuf, uint8_t *rbuf)
       }
       res->version = PROTO_VERSION;
       strncpy(res->verstr, GIT_REPO_VERSION, sizeof(res->verstr) - 1);
+      res->respbase = htobe32(VD_RESP_BASE);
+      res->respslots = htobe32(VD_RESP_SLOTS);
+      res->statbase = htobe32(VD_STAT_BASE);
+      res->statslots = htobe32(VD_STAT_SLOTS);
       break;
     }
 
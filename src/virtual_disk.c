@@ -24,12 +24,16 @@
  */
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <malloc.h>
+#include <unistd.h>
 #include "hardware/watchdog.h"
+#include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 
 #include "smb2.h"
@@ -51,6 +55,7 @@
 //****************************************************************************
 
 int debuglevel = 0;
+uint32_t vd_volume_sects;
 
 //****************************************************************************
 // Static variables
@@ -59,6 +64,39 @@ int debuglevel = 0;
 static int remoteunit;
 static bool remoteboot;
 static bool fastconnect;
+static volatile bool vd_ready;      // connection setup is done
+
+#define STATSSIZE   2048
+static char stats_txt[STATSSIZE];
+static struct iostat remote_stat;   // remote drive commands
+
+/* I/O worker requests */
+enum { IO_READ, IO_WRITE, IO_FLUSH };
+struct vd_ioreq {
+    int op;
+    TaskHandle_t task;              // task to be notified on completion
+    uint32_t lba;
+    uint32_t count;
+    int result;
+};
+static struct vd_ioreq vd_rwreq;    // read/write (uses vd_iobuf)
+static struct vd_ioreq vd_flushreq; // HDS cache write-back
+static struct spsc vd_reqq;         // USB task -> I/O worker
+static struct spsc vd_doneq;        // I/O worker -> USB task
+static bool vd_rwbusy;              // vd_rwreq is posted (USB task only)
+static bool vd_rwdone;              // vd_rwreq is completed (USB task only)
+static bool vd_flushbusy;           // vd_flushreq is posted (USB task only)
+static uint8_t *vd_iobuf;
+
+/* remote communication buffers (allocated from the cache arena) */
+#define VDBUF_SIZE  ((512 - 16) * VDBUF_MAXPAGE)
+
+/* HUMAN.SYS for remote boot (allocated from the cache arena if it fits) */
+#define HUMAN_LBA       (0x8000 / 512)
+#define HUMAN_MAXSIZE   (0x20000 - 0x8000)
+static uint8_t *human_sys;
+static uint32_t human_size;         // 0: not loaded
+static uint64_t human_mtime;
 
 //****************************************************************************
 // for debugging
@@ -74,6 +112,44 @@ void DPRINTF(int level, char *fmt, ...)
   }
 }
 
+//****************************************************************************
+// Statistics
+//****************************************************************************
+
+void iostat_add(struct iostat *s, uint32_t start)
+{
+    uint32_t t = time_us_32() - start;
+    s->count++;
+    s->total += t;
+    if (t > s->max)
+        s->max = t;
+}
+
+int iostat_print(char *buf, size_t size, const char *name, struct iostat *s)
+{
+    int len = snprintf(buf, size, "%-14s count=%u avg=%uus max=%uus\n", name, s->count,
+                       s->count ? (uint32_t)(s->total / s->count) : 0, s->max);
+    return (size_t)len < size ? len : (int)(size - 1);
+}
+
+/* Make the contents of "STATS.TXT" */
+static void stats_txt_make(void)
+{
+    extern char __HeapLimit;
+    struct mallinfo mi = mallinfo();
+    int len;
+
+    len = snprintf(stats_txt, sizeof(stats_txt),
+                   "X68000Z Remote Drive Service statistics\n"
+                   "uptime=%us\n"
+                   "heap: arena=%d used=%d free=%d heapfree=%d\n\n",
+                   to_ms_since_boot(get_absolute_time()) / 1000,
+                   mi.arena, mi.uordblks, mi.fordblks, &__HeapLimit - (char *)sbrk(0));
+    len += hds_cache_stat(&stats_txt[len], sizeof(stats_txt) - len);
+    len += iostat_print(&stats_txt[len], sizeof(stats_txt) - len, "Remote command", &remote_stat);
+    memset(&stats_txt[len], ' ', sizeof(stats_txt) - len);
+}
+
 //****************************************************************************
 // BPB
 //****************************************************************************
@@ -89,7 +165,7 @@ static const uint8_t boot_sector[] = {
     'M', 'S', 'W', 'I', 'N', '4', '.', '1',     //  +3 OEMName
     lsb_hword(512),                             // +11 BytsPerSec
     (CLUSTER_SIZE / SECTOR_SIZE),               // +13 SecPerClus
-    lsb_hword(32),                              // +14 RsvdSecCnt
+    lsb_hword(0),                               // +14 RsvdSecCnt (set at read)
     2,                                          // +16 NumFATs
     lsb_hword(0),                               // +17 RootEntCnt
     lsb_hword(0),                               // +19 TotSec16
@@ -98,8 +174,8 @@ static const uint8_t boot_sector[] = {
     lsb_hword(0x3f),                            // +24 SecPerTrk
     lsb_hword(0xff),                            // +26 NumHeads
     lsb_word(0),                                // +28 HiddSec
-    lsb_word(VOLUME_SECTOR_COUNT),              // +32 TotSec32
-    lsb_word(FAT_SECTORS),                      // +36 FATSz32
+    lsb_word(0),                                // +32 TotSec32 (set at read)
+    lsb_word(0),                                // +36 FATSz32 (set at read)
     lsb_hword(0),                               // +40 ExtFlags
     lsb_hword(0),                               // +42 FSVer
     lsb_word(2),                                // +44 RootClus
@@ -174,6 +250,23 @@ void init_dir_entry(struct dir_entry *entry, const char *fn,
 // Virtual FAT32 functions
 //****************************************************************************
 
+#define CLUSTER_LBA(cl)     (DATA_LBA + ((cl) - 2) * CLUS_PER_SECT)
+#define BUF_SECTS(b)        ((sizeof(b) + SECTOR_SIZE - 1) / SECTOR_SIZE)
+
+/* "disk0～6.hds" images follow the files in the first FAT sector */
+#define HDS_CLUSTER0        FATENTS_SECT                    // 0x80
+#define HDS_LBA             CLUSTER_LBA(HDS_CLUSTER0)       // 0x5fa0
+
+/*
+ * Volume geometry made from the image sizes by vd_init().
+ * The data area is always at DATA_LBA and the FATs are placed just before
+ * it, so a smaller FAT only makes the reserved area larger.
+ */
+static uint32_t vd_fat_sects;       // sectors per FAT
+static uint32_t vd_rsvd_sects;      // reserved sectors (FAT1 starts here)
+static uint32_t hds_cluster[7];     // first cluster of each image
+static uint32_t hds_slot[7];        // clusters reserved for each image (0: not used)
+
 static uint32_t fat[SECTOR_SIZE];
 static uint8_t rootdir[32 * 8];
 static uint8_t x68zdir[32 * 8];
@@ -181,27 +274,732 @@ static uint8_t imagedir[32 * 16];
 static uint8_t pscsiini[256];
 static int imagedir_init = false;
 
+/*
+ * The remote command. The fields other than state and the response belong
+ * to the USB task, and the command is passed to the I/O worker by the state.
+ */
+static struct vdcmd {
+    struct vdbuf_header header;     // the command received last
+    uint32_t wpages;                // pages of the command received so far
+    volatile uint8_t state;         // VDSTAT_*
+    int rpages;                     // max page of the response
+    int rcnt;                       // pages read by the older protocol
+    uint8_t *wbuf;                  // command
+    uint8_t *rbuf;                  // response
+} vdcmd;
+
+static bool vdcmd_frame;            // receiving the data sectors of an aligned frame
+static uint32_t vdcmd_framelba;     // its header sector
+
+static int configtxtlen = 0;
+
+/* Notify that the connection setup is done (called from the connect task) */
+void vd_connected(void)
+{
+    vd_ready = true;
+    xTaskNotify(io_th, VD_NOTIFY_SYNC, eSetBits);
+}
+
+/*
+ * Wait for the connection to be ready (called from the I/O worker task).
+ * The USB task does not post requests for the regions needing the
+ * connection until it is ready, so this normally returns immediately.
+ */
 static void vd_sync(void)
 {
-    static bool synced = false;
-    if (!synced) {
+    while (!vd_ready)
         xTaskNotifyWait(0, 0, NULL, portMAX_DELAY);
-        synced = true;
+}
+
+/*
+ * Load HUMAN.SYS for remote boot into memory with a single read.
+ * The copy is kept while the size and the modification time of the file
+ * are unchanged. Called with remote_sem taken.
+ */
+int vd_human_load(void)
+{
+    char human[256];
+    const char *shpath;
+    struct smb2_context *smb2;
+    struct smb2_stat_64 st;
+    struct smb2fh *sfh;
+
+    if (human_sys == NULL || rootpath[0] == NULL)
+        return -1;
+
+    snprintf(human, sizeof(human), "%s/HUMAN.SYS", rootpath[0]);
+    if ((smb2 = path2smb2(human, &shpath)) == NULL)
+        return -1;
+    if (smb2_stat(smb2, shpath, &st) < 0) {
+        DPRINTF1("HUMAN.SYS not found.\n");
+        return -1;                  // keep the copy if any
+    }
+    if (human_size != 0 && st.smb2_size == human_size && st.smb2_mtime == human_mtime)
+        return 0;                   // not updated
+
+    human_size = 0;
+    if (st.smb2_size == 0 || st.smb2_size > HUMAN_MAXSIZE) {
+        printf("HUMAN.SYS size %" PRIu64 " is not supported.\n", st.smb2_size);
+        return -1;
     }
+    if ((sfh = smb2_open(smb2, shpath, O_RDONLY)) == NULL) {
+        DPRINTF1("HUMAN.SYS open failure.\n");
+        return -1;
+    }
+    uint32_t pos = 0;
+    while (pos < st.smb2_size) {
+        int len = smb2_read(smb2, sfh, &human_sys[pos], st.smb2_size - pos);
+        if (len <= 0)
+            break;
+        pos += len;
+    }
+    smb2_close(smb2, sfh);
+    if (pos < st.smb2_size) {
+        DPRINTF1("HUMAN.SYS read failure.\n");
+        return -1;
+    }
+
+    human_size = st.smb2_size;
+    human_mtime = st.smb2_mtime;
+    DPRINTF1("HUMAN.SYS loaded (%u bytes).\n", human_size);
+    return 0;
 }
 
-int vd_init(void)
+/*
+ * Read a sector of HUMAN.SYS from the server when it is not in memory
+ * (no buffer, or the file could not be loaded). Called with remote_sem taken.
+ */
+static void vd_human_read(uint32_t lba, uint8_t *buf)
 {
-    uint32_t nvalue;
-    struct dir_entry *dirent;
-    int len;
+    static struct smb2_context *smb2;
+    static struct smb2fh *sfh;
+
+    memset(buf, 0, SECTOR_SIZE);
+    if (lba == 0 && sfh != NULL) {
+        /* the boot loader starts reading -- reopen for the file updated */
+        smb2_close(smb2, sfh);
+        sfh = NULL;
+    }
+    if (sfh == NULL) {
+        char human[256];
+        const char *shpath;
+        if (rootpath[0] == NULL)
+            return;
+        snprintf(human, sizeof(human), "%s/HUMAN.SYS", rootpath[0]);
+        if ((smb2 = path2smb2(human, &shpath)) == NULL ||
+            (sfh = smb2_open(smb2, shpath, O_RDONLY)) == NULL) {
+            DPRINTF1("HUMAN.SYS open failure.\n");
+            return;
+        }
+    }
+    if (smb2_pread(smb2, sfh, buf, SECTOR_SIZE, lba * SECTOR_SIZE) < 0) {
+        smb2_close(smb2, sfh);
+        sfh = NULL;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Region handlers
+//----------------------------------------------------------------------------
+
+/*
+ * The volume is described by a table of regions sorted by the start sector.
+ * A region is read and written by its handlers with the sector offset in the
+ * region. Regions with a cluster number are files or directories: their FAT
+ * chains and directory entries are made from the table by vd_init().
+ */
+struct vd_region;
+typedef int (*vd_handler_t)(const struct vd_region *r, uint32_t off, uint8_t *buf);
+
+struct vd_region {
+    uint32_t start;                 // first sector
+    uint32_t sects;                 // number of sectors
+    vd_handler_t read;
+    vd_handler_t write;
+    void *data;                     // backing buffer
+    uint32_t bufsize;               // size of the backing buffer
+    /* directory entry */
+    uint32_t cluster;               // first cluster (0: not a file)
+    const char *name;               // 8.3 name (NULL: no directory entry)
+    uint8_t attr;
+    uint8_t ntres;
+    uint8_t text;                   // file size is the string length in the buffer
+    uint32_t parent;                // cluster of the parent directory
+    uint8_t sync;                   // needs the connection to be ready
+};
+
+static int vd_read_data(const struct vd_region *r, uint32_t off, uint8_t *buf)
+{
+    uint32_t pos = off * SECTOR_SIZE;
+    if (pos >= r->bufsize)
+        return 0;                   // slack of the last cluster
+    memcpy(buf, (uint8_t *)r->data + pos,
+           r->bufsize - pos < SECTOR_SIZE ? r->bufsize - pos : SECTOR_SIZE);
+    return 0;
+}
+
+static int vd_read_boot(const struct vd_region *r, uint32_t off, uint8_t *buf)
+{
+    if (off == 0 || off == 6) {
+        // BPB
+        memcpy(buf, boot_sector, sizeof(boot_sector));
+        buf[14] = vd_rsvd_sects;
+        buf[15] = vd_rsvd_sects >> 8;
+        for (int i = 0; i < 4; i++) {
+            buf[32 + i] = vd_volume_sects >> (i * 8);
+            buf[36 + i] = vd_fat_sects >> (i * 8);
+        }
+        buf[0x1fe] = 0x55;
+        buf[0x1ff] = 0xaa;
+    } else if (off == 1) {
+        // FSINFO
+        memcpy(buf, fsinfo1, sizeof(fsinfo1));
+        memcpy(&buf[484], fsinfo2, sizeof(fsinfo2));
+    }
+    return 0;
+}
+
+/* Find the image containing the sector (from HDS_LBA) and make it the sector in the image */
+static int vd_hds_unit(uint32_t *lba)
+{
+    uint32_t cl = *lba / CLUS_PER_SECT + HDS_CLUSTER0;
+    for (int id = 0; id < 7; id++) {
+        if (hds_slot[id] != 0 &&
+            cl >= hds_cluster[id] && cl < hds_cluster[id] + hds_slot[id]) {
+            *lba -= (hds_cluster[id] - HDS_CLUSTER0) * CLUS_PER_SECT;
+            return id;
+        }
+    }
+    return -1;
+}
+
+static int vd_read_fat(const struct vd_region *r, uint32_t off, uint8_t *buf)
+{
+    if (off < vd_rsvd_sects - 0x20)
+        return 0;                   // rest of the reserved area
+    off = (off - (vd_rsvd_sects - 0x20)) % vd_fat_sects;   // FAT1 and FAT2 are the same
+    if (off == 0) {
+        // FAT for directory and small files
+        memcpy(buf, fat, SECTOR_SIZE);
+    } else {
+        // "disk0～6.hds"ファイル用のFATデータを作る
+        uint32_t *lbuf = (uint32_t *)buf;
+        uint32_t hlba = (off * FATENTS_SECT - HDS_CLUSTER0) * CLUS_PER_SECT;
+        int id = vd_hds_unit(&hlba);
+        if (id >= 0 && diskinfo[id].type != DTYPE_NOTUSED && diskinfo[id].size > 0) {
+            off -= hds_cluster[id] / FATENTS_SECT;
+            // ファイル末尾のクラスタ (ファイル先頭からの番号)
+            // (イメージ同士の隙間がないので、チェインがファイルの範囲を越えてはいけない)
+            int last = (diskinfo[id].size - 1) / CLUSTER_SIZE;
+            // ファイル末尾のクラスタのFATエントリを含むセクタ (1セクタ=128エントリ)
+            int fatsects = last / FATENTS_SECT;
+            // そのセクタ内での末尾のFATエントリの位置
+            int fatmod = last % FATENTS_SECT;
+            // アクセスしようとしているFAT領域先頭のクラスタ番号
+            int clsno = hds_cluster[id] + FATENTS_SECT * off;
+            if (off < fatsects) {
+                // アクセスしようとしているFAT領域のセクタはすべて使用中
+                for (int i = 0; i < FATENTS_SECT; i++) {
+                    lbuf[i] = clsno + i + 1;    // クラスタチェインを作る
+                }
+            } else if (off == fatsects) {
+                // アクセスしようとしているFAT領域のセクタは部分的に使われている
+                for (int i = 0; i < fatmod; i++) {
+                    lbuf[i] = clsno + i + 1;    // クラスタチェインを作る
+                }
+                lbuf[fatmod] = 0x0fffffff;      // クラスタ末尾
+            }
+        }
+    }
+    return 0;
+}
 
+static int vd_write_rootdir(const struct vd_region *r, uint32_t off, uint8_t *buf)
+{
+    /* remember the new size of "config.txt" for the update */
+    for (int i = 0; i < SECTOR_SIZE; i += sizeof(struct dir_entry)) {
+        if (memcmp(&buf[i], "CONFIG  TXT", 11) == 0) {
+            configtxtlen = ((struct dir_entry *)&buf[i])->fileSize;
+            break;
+        }
+    }
+    return 0;
+}
+
+static int vd_write_config(const struct vd_region *r, uint32_t off, uint8_t *buf)
+{
+    // "config.txt" file update
+    memcpy(&configtxt[off * SECTOR_SIZE], buf, SECTOR_SIZE);
+    if (configtxtlen > 0 && off == (configtxtlen - 1) / SECTOR_SIZE) {
+        if (configtxtlen < sizeof(configtxt))
+            configtxt[configtxtlen] = '\0';
+        configtxt[sizeof(configtxt) - 1] = '\0';
+        config_parse(configtxt);
+        config_write();
+
+        // reboot by watchdog
+        watchdog_enable(500, 1);
+        while (1)
+            ;
+    }
+    return 0;
+}
+
+static struct dir_entry *vd_make_dir(uint8_t *dir, size_t size, uint32_t cluster, uint32_t parent);
+
+static int vd_read_imagedir(const struct vd_region *r, uint32_t off, uint8_t *buf)
+{
+    if (!imagedir_init) {
+        /* Lazy initialization of "X68000Z/image" directory */
+        struct dir_entry *dirent;
+        vd_sync();
+        dirent = vd_make_dir(imagedir, sizeof(imagedir), r->cluster, r->parent);
+        for (int i = 0; i < 7; i++) {
+            struct diskinfo *di = &diskinfo[i];
+            if (di->type != DTYPE_NOTUSED) {
+                char fn[16];
+                sprintf(fn, "%d%s HDS", i,
+                        diskinfo[i].type == DTYPE_REMOTEBOOT ? "REMOTE" :
+                        (diskinfo[i].type == DTYPE_HDS ? "RMTHDS" : "RMTCOM"));
+                init_dir_entry(dirent++, fn, 0, 0x18, hds_cluster[i], diskinfo[i].size);
+            }
+        }
+        imagedir_init = true;
+    }
+    return vd_read_data(r, off, buf);
+}
+
+static int vd_read_stats(const struct vd_region *r, uint32_t off, uint8_t *buf)
+{
+    // "X68000Z/stats.txt" file (made when the first sector is read)
+    if (off == 0)
+        stats_txt_make();
+    return vd_read_data(r, off, buf);
+}
+
+/* Run the remote command received (called from the I/O worker task) */
+static void vd_remote_run(void)
+{
+    struct vdcmd *c = &vdcmd;
+    int rsize;
+
+    c->state = VDSTAT_RUNNING;
+    xSemaphoreTake(remote_sem, portMAX_DELAY);
+    cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 1);
+    if ((rsize = vd_command(c->wbuf, c->rbuf)) < 0) {
+        uint32_t start = time_us_32();
+        rsize = remote_serv(c->wbuf, c->rbuf);
+        iostat_add(&remote_stat, start);
+    }
+    cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 0);
+    xSemaphoreGive(remote_sem);
+    if (c->header.flags & VDBUF_FRAME)
+        c->rpages = (rsize <= 0) ? 0 : ((rsize - 1) / SECTOR_SIZE + 1);
+    else
+        c->rpages = (rsize < 0) ? 0 : ((rsize - 1) / (512 - 16));
+    c->rcnt = 0;
+    DPRINTF3("rpages=%d\n", c->rpages);
+
+    /* the response is visible to the USB task after this */
+    __mem_fence_release();
+    c->state = VDSTAT_DONE;
+}
+
+/*
+ * Receive a sector of a remote command (USB task).
+ * The command is run by the I/O worker when all of its pages are received.
+ */
+static int vd_write_command(uint32_t lba, uint8_t *buf)
+{
+    struct vdbuf *b = (struct vdbuf *)buf;
+    struct vdcmd *c = &vdcmd;
+
+    if (vdcmd_frame &&
+        lba > vdcmd_framelba && lba <= vdcmd_framelba + c->header.maxpage) {
+        /* data sector of an aligned frame command */
+        int page = lba - vdcmd_framelba - 1;
+        memcpy(&c->wbuf[page * SECTOR_SIZE], buf, SECTOR_SIZE);
+        c->wpages |= 1u << page;
+        if (c->wpages == (1u << c->header.maxpage) - 1) {
+            c->wpages = 0;
+            vdcmd_frame = false;
+            __mem_fence_release();
+            c->state = VDSTAT_QUEUED;
+            xTaskNotify(io_th, VD_NOTIFY_CMD, eSetBits);
+        }
+        return 0;
+    }
+    vdcmd_frame = false;
+
+    if (b->header.signature != 0x5a383658) {   /* "X68Z" (big endian) */
+        return -1;
+    }
+    if (c->state == VDSTAT_QUEUED || c->state == VDSTAT_RUNNING) {
+        /* the host must wait for the previous command to complete */
+        return -1;
+    }
+    if (b->header.flags & VDBUF_FRAME) {
+        if (b->header.page != 0 || b->header.maxpage == 0 ||
+            b->header.maxpage > VDBUF_SIZE / SECTOR_SIZE) {
+            return -1;
+        }
+        /* frame header -- the data sectors follow in the same transfer */
+        c->state = VDSTAT_NONE;
+        c->header = b->header;
+        c->wpages = 0;
+        vdcmd_frame = true;
+        vdcmd_framelba = lba;
+        return 0;
+    }
+    if (b->header.page > b->header.maxpage || b->header.maxpage >= VDBUF_MAXPAGE) {
+        return -1;
+    }
+    if (b->header.session != c->header.session || b->header.seqno != c->header.seqno ||
+        (c->header.flags & VDBUF_FRAME)) {
+        c->wpages = 0;          // a new command
+    }
+    c->state = VDSTAT_NONE;
+    c->header = b->header;
+    memcpy(&c->wbuf[b->header.page * (512 - 16)], b->buf, sizeof(b->buf));
+    /* The pages may come as one multi-sector transfer or one by one. */
+    c->wpages |= 1u << b->header.page;
+    if (c->wpages == (2u << b->header.maxpage) - 1) {
+        c->wpages = 0;
+        __mem_fence_release();
+        c->state = VDSTAT_QUEUED;
+        xTaskNotify(io_th, VD_NOTIFY_CMD, eSetBits);
+    }
+    return 0;
+}
+
+/* Make the status sector of a remote command */
+static void vd_read_status(struct vdcmd *c, uint8_t *buf)
+{
+    struct vdstat *st = (struct vdstat *)buf;
+    uint8_t state = c->state;
+
+    __mem_fence_acquire();
+    memset(buf, 0, SECTOR_SIZE);
+    st->header = c->header;
+    st->header.page = 0;
+    st->header.maxpage = (state == VDSTAT_DONE) ? c->rpages : 0;
+    st->state = state;
+}
+
+/* Make a response page sector of the remote communication disk */
+static void vd_read_response(uint32_t lba, uint8_t *buf)
+{
+    struct vdbuf *b = (struct vdbuf *)buf;
+    struct vdcmd *c = &vdcmd;
+    int page;
+
+    if (lba >= VD_STAT_BASE && lba < VD_STAT_BASE + VD_STAT_SLOTS) {
+        vd_read_status(c, buf);
+        return;
+    }
+    if (c->state != VDSTAT_DONE) {
+        /* no response yet -- the header does not match the command */
+        memset(buf, 0, SECTOR_SIZE);
+        return;
+    }
+    __mem_fence_acquire();
+
+    if (lba >= VD_RESP_BASE && lba < VD_RESP_BASE + VD_RESP_SLOTS * VDBUF_MAXPAGE) {
+        /* response window -- the page is given by the sector */
+        page = (lba - VD_RESP_BASE) % VDBUF_MAXPAGE;
+        if (c->header.flags & VDBUF_FRAME) {
+            /* aligned frame -- the header sector is followed by the raw data sectors */
+            if (page == 0) {
+                memset(buf, 0, SECTOR_SIZE);
+                b->header = c->header;
+                b->header.maxpage = c->rpages;
+            } else if (page <= VDBUF_SIZE / SECTOR_SIZE) {
+                memcpy(buf, &c->rbuf[(page - 1) * SECTOR_SIZE], SECTOR_SIZE);
+            } else {
+                memset(buf, 0, SECTOR_SIZE);
+            }
+            return;
+        }
+    } else if (c->header.flags & VDBUF_FRAME) {
+        memset(buf, 0, SECTOR_SIZE);
+        return;
+    } else {
+        /* older protocol -- the page follows the sectors read so far */
+        page = c->rcnt + (lba % 8);
+        if ((lba % 8) == 7) {
+            c->rcnt += 8;
+        }
+    }
+
+    if (page < VDBUF_SIZE / sizeof(b->buf)) {
+        b->header = c->header;
+        b->header.maxpage = c->rpages;
+        b->header.page = page;
+        memcpy(b->buf, &c->rbuf[page * sizeof(b->buf)], sizeof(b->buf));
+    } else {
+        memset(buf, 0, SECTOR_SIZE);
+    }
+}
+
+static int vd_read_hds(const struct vd_region *r, uint32_t lba, uint8_t *buf)
+{
+    // "disk0～6.hds" file read
+    int id = vd_hds_unit(&lba);
+    if (id < 0 || diskinfo[id].type == DTYPE_NOTUSED)
+        return 0;
+    if (lba >= diskinfo[id].sects)
+        return 0;
+    DPRINTF3("disk %d: read 0x%x\n", id, lba);
+
+    vd_sync();
+
+    if (diskinfo[id].type == DTYPE_HDS && diskinfo[id].sfh != NULL) {
+        if (lba == 2) {
+            // boot loader
+            memcpy(buf, hdsboot, sizeof(hdsboot));
+            return 0;
+        }
+        if (lba == 0x20 || lba == 0x21) {
+            lba -= 0x20 - 2;
+        }
+        if (hds_cache_read(&diskinfo[id], lba, 1, buf) < 0)
+            return -1;
+        return 0;
+    }
+
+    if (diskinfo[id].type == DTYPE_REMOTEBOOT ||
+        diskinfo[id].type == DTYPE_REMOTECOMM) {
+        if (lba == 0) {
+            // SCSI disk signature
+            memcpy(buf, "X68SCSI1", 8);
+            memcpy(&buf[16], "X68000ZRemoteDrv", 16);
+            return 0;
+        } else if (lba == 2) {
+            // boot loader
+            memcpy(buf, bootloader, sizeof(bootloader));
+            if (diskinfo[id].type == DTYPE_REMOTEBOOT)
+                buf[5] = remoteboot ? sysstatus : 0;
+            return 0;
+        }
+    }
+    if (diskinfo[id].type == DTYPE_REMOTEBOOT ||
+        (!remoteboot && diskinfo[id].type == DTYPE_REMOTECOMM)) {
+        if (lba == 4) {
+            // SCSI partition signature
+            memcpy(buf, "X68K", 4);
+            for (int i = 0; i < remoteunit; i++) {
+                memcpy(buf + 16 + i * 16, "Human68k", 8);
+            }
+            return 0;
+        } else if (lba >= (0x0c00 / 512) && lba < (0x4000 / 512)) {
+            // SCSI device driver
+            lba -= 0xc00 / 512;
+            if (lba <= sizeof(scsiremote) / 512) {
+                memcpy(buf, &scsiremote[lba * 512], 512);
+            }
+            return 0;
+        }
+    }
+    if (diskinfo[id].type == DTYPE_REMOTEBOOT) {
+        if (lba >= HUMAN_LBA && lba < (0x20000 / 512)) {
+            // HUMAN.SYS
+            lba -= HUMAN_LBA;
+            if (lba == 0) {
+                /* the boot loader starts reading -- reload if the file is updated */
+                xSemaphoreTake(remote_sem, portMAX_DELAY);
+                vd_human_load();
+                xSemaphoreGive(remote_sem);
+            }
+            if (human_size == 0) {
+                /* not in memory -- read from the server */
+                xSemaphoreTake(remote_sem, portMAX_DELAY);
+                vd_human_read(lba, buf);
+                xSemaphoreGive(remote_sem);
+            } else if (lba * 512 < human_size) {
+                uint32_t len = human_size - lba * 512;
+                memcpy(buf, &human_sys[lba * 512], len < 512 ? len : 512);
+            }
+            return 0;
+        }
+    }
+    if (diskinfo[id].type == DTYPE_REMOTECOMM) {
+        if (lba >= (0x20000 / 512) && lba < (0x40000 / 512)) {
+            // settingui.bin
+            lba -= 0x20000 / 512;
+            if (lba <= sizeof(settingui) / 512) {
+                memcpy(buf, &settingui[lba * 512], 512);
+            }
+            return 0;
+        } else if (lba >= (0x40000 / 512)) {
+            vd_read_response(lba, buf);
+            return 0;
+        }
+    }
+
+    if (diskinfo[id].type == DTYPE_HDS)
+        return -1;                  // the image could not be opened
+    return 0;
+}
+
+static int vd_write_hds(const struct vd_region *r, uint32_t lba, uint8_t *buf)
+{
+    // "disk0～6.hds" file write
+    int id = vd_hds_unit(&lba);
+    if (id < 0 || diskinfo[id].type == DTYPE_NOTUSED)
+        return 0;
+    if (lba >= diskinfo[id].sects)
+        return 0;
+    DPRINTF3("disk %d: write 0x%x\n", id, lba);
+
+    vd_sync();
+
+    if (diskinfo[id].type == DTYPE_HDS && diskinfo[id].sfh != NULL) {
+        if (hds_cache_write(&diskinfo[id], lba, 1, buf) < 0)
+            return -1;
+        return 0;
+    }
+    if (diskinfo[id].type == DTYPE_REMOTECOMM) {
+        return vd_write_command(lba, buf);
+    }
+
+    if (diskinfo[id].type == DTYPE_HDS)
+        return -1;                  // the image could not be opened
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// Region table
+//----------------------------------------------------------------------------
+
+static const struct vd_region vd_regions[] = {
+    {   /* BPB, FSINFO and their backups */
+        .start = 0, .sects = 0x20, .read = vd_read_boot },
+    {   /* reserved area, FAT1 and FAT2 (the FATs are at the end) */
+        .start = 0x20, .sects = MAX_FAT_SECTORS * 2, .read = vd_read_fat },
+    {   /* root directory */
+        .start = CLUSTER_LBA(2), .sects = BUF_SECTS(rootdir),
+        .read = vd_read_data, .write = vd_write_rootdir,
+        .data = rootdir, .bufsize = sizeof(rootdir),
+        .cluster = 2 },
+    {   /* "X68000Z" directory */
+        .start = CLUSTER_LBA(3), .sects = BUF_SECTS(x68zdir),
+        .read = vd_read_data,
+        .data = x68zdir, .bufsize = sizeof(x68zdir),
+        .cluster = 3, .name = "X68000Z    ", .attr = ATTR_DIR, .parent = 2 },
+    {   /* "X68000Z/pscsi.ini" */
+        .start = CLUSTER_LBA(4), .sects = BUF_SECTS(pscsiini),
+        .read = vd_read_data,
+        .data = pscsiini, .bufsize = sizeof(pscsiini),
+        .cluster = 4, .name = "PSCSI   INI", .ntres = 0x18, .text = 1, .parent = 3 },
+    {   /* "log.txt" */
+        .start = CLUSTER_LBA(5), .sects = BUF_SECTS(log_txt),
+        .read = vd_read_data,
+        .data = log_txt, .bufsize = sizeof(log_txt),
+        .cluster = 5, .name = "LOG     TXT", .ntres = 0x18, .parent = 2 },
+    {   /* "config.txt" */
+        .start = CLUSTER_LBA(6), .sects = BUF_SECTS(configtxt),
+        .read = vd_read_data, .write = vd_write_config,
+        .data = configtxt, .bufsize = sizeof(configtxt),
+        .cluster = 6, .name = "CONFIG  TXT", .ntres = 0x18, .text = 1, .parent = 2 },
+    {   /* "X68000Z/image" directory */
+        .start = CLUSTER_LBA(7), .sects = BUF_SECTS(imagedir),
+        .read = vd_read_imagedir,
+        .data = imagedir, .bufsize = sizeof(imagedir),
+        .cluster = 7, .name = "IMAGE      ", .attr = ATTR_DIR, .ntres = 0x18, .parent = 3,
+        .sync = 1 },
+    {   /* "X68000Z/stats.txt" */
+        .start = CLUSTER_LBA(8), .sects = BUF_SECTS(stats_txt),
+        .read = vd_read_stats,
+        .data = stats_txt, .bufsize = sizeof(stats_txt),
+        .cluster = 8, .name = "STATS   TXT", .ntres = 0x18, .parent = 3 },
+    {   /* "X68000Z/image/disk0～6.hds" (FAT chains and entries are made separately) */
+        .start = HDS_LBA, .sects = (MAX_CLUSTER - HDS_CLUSTER0) * CLUS_PER_SECT,
+        .read = vd_read_hds, .write = vd_write_hds,
+        .cluster = HDS_CLUSTER0, .sync = 1 },
+};
+
+/* Find the region containing the sector by binary search */
+static const struct vd_region *vd_region_find(uint32_t lba)
+{
+    int lo = 0;
+    int hi = countof(vd_regions);
+
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (lba < vd_regions[mid].start)
+            hi = mid;
+        else
+            lo = mid;
+    }
+    const struct vd_region *r = &vd_regions[lo];
+    return (lba - r->start < r->sects) ? r : NULL;
+}
+
+/* Check if the sectors include a region needing the connection */
+static bool vd_region_sync(uint32_t lba, uint32_t count)
+{
+    uint32_t end = lba + count;
+
+    while (lba < end) {
+        const struct vd_region *r = vd_region_find(lba);
+        if (r == NULL) {
+            lba++;
+            continue;
+        }
+        if (r->sync)
+            return true;
+        lba = r->start + r->sects;
+    }
+    return false;
+}
+
+/* Make the directory entries of the files in the directory from the region table */
+static struct dir_entry *vd_make_dir(uint8_t *dir, size_t size, uint32_t cluster, uint32_t parent)
+{
+    struct dir_entry *dirent = (struct dir_entry *)dir;
+
+    memset(dir, 0, size);
+    if (cluster != 2) {
+        init_dir_entry(dirent++, ".          ", ATTR_DIR, 0, cluster, 0);
+        init_dir_entry(dirent++, "..         ", ATTR_DIR, 0, parent == 2 ? 0 : parent, 0);
+    }
+    for (int i = 0; i < countof(vd_regions); i++) {
+        const struct vd_region *r = &vd_regions[i];
+        if (r->name == NULL || r->parent != cluster)
+            continue;
+        uint32_t len = (r->attr & ATTR_DIR) ? 0 :
+                       (r->text ? strlen(r->data) : r->bufsize);
+        init_dir_entry(dirent++, r->name, r->attr, r->ntres, r->cluster, len);
+    }
+    return dirent;
+}
+
+/* Cache arena size used by vd_init() */
+size_t vd_arena_size(void)
+{
+    return VDBUF_SIZE * 2 + VD_MAX_SECTS * SECTOR_SIZE;
+}
+
+int vd_init(void)
+{
     setenv("TZ", config.tz, true);
 
     remoteunit = atoi(config.remoteunit);
     remoteboot = atoi(config.remoteboot);
     fastconnect = atoi(config.fastconnect);
 
+    /* the HDS cache takes all the rest of the arena */
+    vdcmd.rbuf = arena_alloc(VDBUF_SIZE);
+    vdcmd.wbuf = arena_alloc(VDBUF_SIZE);
+    vd_iobuf = arena_alloc(VD_MAX_SECTS * SECTOR_SIZE);
+    /*
+     * HUMAN.SYS is kept in memory only if the cache still gets its minimum.
+     * Otherwise vd_human_read() serves it from the server.
+     */
+    if (remoteboot && arena_avail() >= HUMAN_MAXSIZE + hds_cache_min_size())
+        human_sys = arena_alloc(HUMAN_MAXSIZE);
+    hds_cache_init();
+
     if (strlen(config.wifi_ssid) == 0 || strlen(config.smb2_server) == 0) {
         /* not configured */
         for (int i = 0; i < 6; i++) {
@@ -234,6 +1032,38 @@ int vd_init(void)
         diskinfo[i].sects = (diskinfo[i].size + SECTOR_SIZE - 1) / SECTOR_SIZE;
     }
 
+    /*
+     * Lay out the images and size the FAT to cover them. The size of HDS is
+     * not known until connected, so its slot is for the tentative (maximum)
+     * size, and the geometry is not remade after vd_mount():
+     *  - The host reads the capacity and BPB as soon as USB is enumerated,
+     *    before WiFi and SMB2 are up. NOT READY is only returned for the
+     *    image regions; holding the whole volume until connected would also
+     *    hide config.txt, the only way to fix the settings from the host
+     *    when the connection never succeeds.
+     *  - Once the host has mounted the volume, changing its size or the
+     *    image positions needs a media change the host is not prepared for.
+     * The slot only reserves cluster numbers, as the FAT sectors of images
+     * are made on the fly. The FAT chain and the directory entry of the
+     * image follow the actual size.
+     */
+    uint32_t clusters = HDS_CLUSTER0;
+    for (int i = 0; i < 7; i++) {
+        hds_cluster[i] = hds_slot[i] = 0;
+        if (diskinfo[i].type == DTYPE_NOTUSED)
+            continue;
+        /* each image starts at a FAT sector boundary */
+        uint32_t n = (diskinfo[i].sects + CLUS_PER_SECT - 1) / CLUS_PER_SECT;
+        hds_cluster[i] = clusters;
+        hds_slot[i] = (n + FATENTS_SECT - 1) / FATENTS_SECT * FATENTS_SECT;
+        clusters += hds_slot[i];
+    }
+    if (clusters < MIN_CLUSTER + 2)
+        clusters = MIN_CLUSTER + 2;
+    vd_fat_sects = (clusters + FATENTS_SECT - 1) / FATENTS_SECT;
+    vd_rsvd_sects = DATA_LBA - vd_fat_sects * 2;
+    vd_volume_sects = DATA_LBA + (vd_fat_sects * FATENTS_SECT - 2) * CLUS_PER_SECT;
+
     strcpy(pscsiini, "[pscsi]\r\n");
     for (int i = 0; i < 7; i++) {
         if (diskinfo[i].type != DTYPE_NOTUSED) {
@@ -246,350 +1076,315 @@ int vd_init(void)
         }
     }
 
-    /* Initialize FAT */
+    /* Initialize FAT and directories from the region table */
 
     memset(fat, 0, sizeof(fat));
     fat[0] = 0x0fffff00u | MEDIA_TYPE;
     fat[1] = 0x0fffffff;
-    fat[2] = 0x0ffffff8;    /* cluster 2: root directory */
-    fat[3] = 0x0fffffff;    /* cluster 3: X68000Z directory */
-    fat[4] = 0x0fffffff;    /* cluster 4: pscsi.ini */
-    fat[5] = 0x0fffffff;    /* cluster 5: log.txt */
-    fat[6] = 0x0fffffff;    /* cluster 6: config.txt */
-    fat[7] = 0x0fffffff;    /* cluster 7: X68000Z/image directory */
-
-    /* Initialize root directory */
-
-    memset(rootdir, 0, sizeof(rootdir));
-    dirent = (struct dir_entry *)rootdir;
-    init_dir_entry(dirent++, "LOG     TXT", 0, 0x18, 5, LOGSIZE);
-    init_dir_entry(dirent++, "CONFIG  TXT", 0, 0x18, 6, strlen(configtxt));
-    init_dir_entry(dirent++, "X68000Z    ", ATTR_DIR, 0, 3, 0);
+    for (int i = 0; i < countof(vd_regions); i++) {
+        const struct vd_region *r = &vd_regions[i];
+        if (r->cluster == 0 || r->cluster >= HDS_CLUSTER0)
+            continue;
+        /* files in the first FAT sector (cluster < 128) */
+        int n = (r->sects + CLUS_PER_SECT - 1) / CLUS_PER_SECT;
+        for (int c = 0; c < n - 1; c++)
+            fat[r->cluster + c] = r->cluster + c + 1;
+        fat[r->cluster + n - 1] = 0x0fffffff;
+    }
 
 #if 0
     if (!fastconnect)
         vd_sync();
 #endif
 
-    /* Initialize "X68000Z" directory */
-
-    memset(x68zdir, 0,  sizeof(x68zdir));
-    dirent = (struct dir_entry *)x68zdir;
-    init_dir_entry(dirent++, ".          ", ATTR_DIR, 0, 3, 0);
-    init_dir_entry(dirent++, "..         ", ATTR_DIR, 0, 0, 0);
-    init_dir_entry(dirent++, "PSCSI   INI", 0, 0x18, 4, strlen(pscsiini));
-    init_dir_entry(dirent++, "IMAGE      ", ATTR_DIR, 0x18, 7, 0);
+    vd_make_dir(rootdir, sizeof(rootdir), 2, 0);
+    vd_make_dir(x68zdir, sizeof(x68zdir), 3, 2);
 
     return 0;
 }
 
-uint8_t vdbuf_read[(512 - 16) * 8 * 4];
-uint8_t vdbuf_write[(512 - 16) * 8 * 4];
-int vdbuf_rpages;
-int vdbuf_rcnt;
-
-struct vdbuf_header vdbuf_header;
-
 int vd_read_block(uint32_t lba, uint8_t *buf)
 {
+    const struct vd_region *r;
+
     memset(buf, 0, 512);
+    if ((r = vd_region_find(lba)) == NULL || r->read == NULL)
+        return 0;                   // unused sectors read as zero
+    return r->read(r, lba - r->start, buf);
+}
 
-    if (lba < 0x20) {
-        if (lba == 0 || lba == 6) {
-            // BPB
-            memcpy(buf, boot_sector, sizeof(boot_sector));
-            buf[0x1fe] = 0x55;
-            buf[0x1ff] = 0xaa;
-        } else if (lba == 1) {
-            // FSINFO
-            memcpy(buf, fsinfo1, sizeof(fsinfo1));
-            memcpy(&buf[484], fsinfo2, sizeof(fsinfo2));
-        }
-        return 0;
-    }
+int vd_write_block(uint32_t lba, uint8_t *buf)
+{
+    const struct vd_region *r;
 
-    if (lba < 0x4020) {
-        // FAT
-        lba -= 0x20;
-        if (lba >= 0x2000) {
-            lba -= 0x2000;
-        }
-        if (lba == 0) {
-            // FAT for directory and small files
-            memcpy(buf, fat, SECTOR_SIZE);
-        } else if (lba >= 0x400) {
-            // "disk0～6.hds"ファイル用のFATデータを作る
-            uint32_t *lbuf = (uint32_t *)buf;
-            int id = (lba - 0x400) / 0x400;
-            lba %= 0x400;
-            if (diskinfo[id].type != DTYPE_NOTUSED) {
-                // 1セクタ分のFAT領域(512/4=128エントリ)が占めるディスク領域 (128*32kB = 4MB)
-                int fatdsz = FATENTS_SECT * CLUSTER_SIZE;
-                // ファイルに使用するFAT領域のセクタ数(1セクタ未満切り捨て)
-                int fatsects = diskinfo[id].size / fatdsz;
-                // 1セクタに満たない分のFATエントリ数
-                int fatmod = (diskinfo[id].size % fatdsz) / CLUSTER_SIZE;
-                // アクセスしようとしているFAT領域先頭のクラスタ番号
-                int clsno = 0x20000 + id * 0x20000 + FATENTS_SECT * lba;
-                if (lba < fatsects) {
-                    // アクセスしようとしているFAT領域のセクタはすべて使用中
-                    for (int i = 0; i < FATENTS_SECT; i++) {
-                        lbuf[i] = clsno + i + 1;    // クラスタチェインを作る
-                    }
-                } else if (lba == fatsects) {
-                    // アクセスしようとしているFAT領域のセクタは部分的に使われている
-                    for (int i = 0; i < fatmod; i++) {
-                        lbuf[i] = clsno + i + 1;    // クラスタチェインを作る
-                    }
-                    lbuf[fatmod] = 0x0fffffff;      // クラスタ末尾
-                }
-            }
-        }
-        return 0;
-    }
+    if ((r = vd_region_find(lba)) == NULL || r->write == NULL)
+        return 0;                   // writes to read-only sectors are ignored
+    return r->write(r, lba - r->start, buf);
+}
+
+/* Get the HDS unit if the transfer lies within the cached area of one HDS image */
+static struct diskinfo *vd_hds_range(uint32_t lba, uint32_t count, uint32_t *hdslba)
+{
+    if (lba < HDS_LBA)
+        return NULL;
+    lba -= HDS_LBA;
+    int id = vd_hds_unit(&lba);
+    if (id < 0 || diskinfo[id].type != DTYPE_HDS || diskinfo[id].sfh == NULL)
+        return NULL;
+    if (lba < 0x22 || lba + count > diskinfo[id].sects)
+        return NULL;        // boot loader and remapped sectors are handled one by one
+    *hdslba = lba;
+    return &diskinfo[id];
+}
+
+/*
+ * Make the remote command response sectors directly in the USB buffer.
+ * The response is completed by the worker before the host reads it, so
+ * this needs no network access and no copy through vd_iobuf.
+ */
+static bool vd_comm_response(uint32_t lba, uint32_t count, uint8_t *buf)
+{
+    if (lba < HDS_LBA)
+        return false;
+    lba -= HDS_LBA;
+    int id = vd_hds_unit(&lba);
+    if (id < 0 || diskinfo[id].type != DTYPE_REMOTECOMM)
+        return false;
+    if (lba < (0x40000 / 512) || lba + count > diskinfo[id].sects)
+        return false;
+    for (int i = 0; i < count; i++)
+        vd_read_response(lba + i, buf + i * SECTOR_SIZE);
+    return true;
+}
 
-    if (lba == 0x4020) {
-        // Root directory
-        memcpy(buf, rootdir, sizeof(rootdir));
+/*
+ * Receive the remote command sectors in the USB task as well, so that the
+ * WRITE does not wait behind disk requests. The worker runs the command.
+ * Returns 0 if the range is not on the remote communication disk, and
+ * VD_IO_ERROR if a sector was rejected.
+ */
+static int vd_comm_command(uint32_t lba, uint32_t count, uint8_t *buf)
+{
+    if (lba < HDS_LBA)
         return 0;
-    }
-    if (lba == 0x4060) {
-        // "X68000Z" directory
-        memcpy(buf, x68zdir, sizeof(x68zdir));
+    lba -= HDS_LBA;
+    int id = vd_hds_unit(&lba);
+    if (id < 0 || diskinfo[id].type != DTYPE_REMOTECOMM)
         return 0;
-    }
-    if (lba == 0x40a0) {
-        // "pscsi.ini" file
-        strcpy(buf, pscsiini);
+    if (lba + count > diskinfo[id].sects)
         return 0;
+    for (int i = 0; i < count; i++) {
+        if (vd_write_command(lba + i, buf + i * SECTOR_SIZE) < 0)
+            return VD_IO_ERROR;
     }
+    return count;
+}
 
-    if (lba == 0x40e0 || lba == 0x40e1) {
-        // "log.txt" file
-        memcpy(buf, &log_txt[(lba - 0x40e0) * SECTOR_SIZE], SECTOR_SIZE);
-        return 0;
-    }
+int vd_read_blocks(uint32_t lba, uint32_t count, uint8_t *buf)
+{
+    struct diskinfo *di;
+    uint32_t hdslba;
+    int res = 0;
 
-    if (lba >= 0x4120 && lba < 0x4124) {
-        // "config.txt" file
-        memcpy(buf, &configtxt[(lba - 0x4120) * SECTOR_SIZE], SECTOR_SIZE);
+    if ((di = vd_hds_range(lba, count, &hdslba)) != NULL) {
+        DPRINTF3("disk %d: read 0x%x-0x%x\n", di - diskinfo, hdslba, hdslba + count - 1);
+        vd_sync();
+        if (hds_cache_read(di, hdslba, count, buf) < 0) {
+            memset(buf, 0, count * SECTOR_SIZE);
+            return -1;
+        }
         return 0;
     }
 
-    if (lba == 0x4160) {
-        // "X68000Z/image" directory
-        if (!imagedir_init) {
-            /* Lazy initialization of "X68000Z/image" directory */
-            struct dir_entry *dirent;
-            vd_sync();
-            memset(imagedir, 0,  sizeof(imagedir));
-            dirent = (struct dir_entry *)imagedir;
-            init_dir_entry(dirent++, ".          ", ATTR_DIR, 0, 4, 0);
-            init_dir_entry(dirent++, "..         ", ATTR_DIR, 0, 0, 0);
-            for (int i = 0; i < 7; i++) {
-                struct diskinfo *di = &diskinfo[i];
-                if (di->type != DTYPE_NOTUSED) {
-                    char fn[16];
-                    sprintf(fn, "%d%s HDS", i,
-                            diskinfo[i].type == DTYPE_REMOTEBOOT ? "REMOTE" : 
-                            (diskinfo[i].type == DTYPE_HDS ? "RMTHDS" : "RMTCOM"));
-                    init_dir_entry(dirent++, fn, 0, 0x18, 0x20000 + 0x20000 * i, diskinfo[i].size);
-                }
-            }
-            imagedir_init = true;
-        }
-        memcpy(buf, imagedir, sizeof(imagedir));
-        return 0;
+    for (int i = 0; i < count; i++) {
+        if (vd_read_block(lba + i, buf + i * SECTOR_SIZE) < 0)
+            res = -1;
     }
+    return res;
+}
 
-    if (lba >= 0x00803fa0) {
-        // "disk0～6.hds" file read
-        lba -= 0x00803fa0;
-        int id = lba / 0x800000;
-        lba %= 0x800000;
-        if (diskinfo[id].type == DTYPE_NOTUSED)
-            return -1;
-        if (lba >= diskinfo[id].sects)
-            return -1;
-        DPRINTF3("disk %d: read 0x%x\n", id, lba);
+int vd_write_blocks(uint32_t lba, uint32_t count, uint8_t *buf)
+{
+    struct diskinfo *di;
+    uint32_t hdslba;
+    int res = 0;
 
+    if ((di = vd_hds_range(lba, count, &hdslba)) != NULL) {
+        DPRINTF3("disk %d: write 0x%x-0x%x\n", di - diskinfo, hdslba, hdslba + count - 1);
         vd_sync();
+        return hds_cache_write(di, hdslba, count, buf);
+    }
 
-        if (diskinfo[id].type == DTYPE_HDS && diskinfo[id].sfh != NULL) {
-            if (lba == 2) {
-                // boot loader
-                memcpy(buf, hdsboot, sizeof(hdsboot));
-                return 0;
-            }
-            if (lba == 0x20 || lba == 0x21) {
-                lba -= 0x20 - 2;
-            }
-            if (hds_cache_read(diskinfo[id].smb2, diskinfo[id].sfh, lba, buf) < 0)
-                return -1;
-            return 0;
-        }
+    for (int i = 0; i < count; i++) {
+        if (vd_write_block(lba + i, buf + i * SECTOR_SIZE) < 0)
+            res = -1;
+    }
+    return res;
+}
 
-        if (diskinfo[id].type == DTYPE_REMOTEBOOT ||
-            diskinfo[id].type == DTYPE_REMOTECOMM) {
-            if (lba == 0) {
-                // SCSI disk signature
-                memcpy(buf, "X68SCSI1", 8);
-                memcpy(&buf[16], "X68000ZRemoteDrv", 16);
-                return 0;
-            } else if (lba == 2) {
-                // boot loader
-                memcpy(buf, bootloader, sizeof(bootloader));
-                if (diskinfo[id].type == DTYPE_REMOTEBOOT)
-                    buf[5] = remoteboot ? sysstatus : 0;
-                return 0;
-            }
-        }
-        if (diskinfo[id].type == DTYPE_REMOTEBOOT ||
-            (!remoteboot && diskinfo[id].type == DTYPE_REMOTECOMM)) {
-            if (lba == 4) {
-                // SCSI partition signature
-                memcpy(buf, "X68K", 4);
-                for (int i = 0; i < remoteunit; i++) {
-                    memcpy(buf + 16 + i * 16, "Human68k", 8);
-                }
-                return 0;
-            } else if (lba >= (0x0c00 / 512) && lba < (0x4000 / 512)) {
-                // SCSI device driver
-                lba -= 0xc00 / 512;
-                if (lba <= sizeof(scsiremote) / 512) {
-                    memcpy(buf, &scsiremote[lba * 512], 512);
-                }
-                return 0;
-            }
-        }
-        if (diskinfo[id].type == DTYPE_REMOTEBOOT) {
-            if (lba >= (0x8000 / 512) && lba < (0x20000 / 512)) {
-                // HUMAN.SYS
-                lba -= 0x8000 / 512;
-                uint64_t cur;
-                static uint32_t humanlbamax = (uint32_t)-1;
-                if (lba <= humanlbamax && diskinfo[id].sfh == NULL) {
-                    char human[256];
-                    strcpy(human, rootpath[0]);
-                    strcat(human, "/HUMAN.SYS");
-                    const char *shpath;
-                    diskinfo[id].smb2 = path2smb2(human, &shpath);
-                    char *p = strchr(human, '/') + 1;
-                    if ((diskinfo[id].sfh = smb2_open(diskinfo[id].smb2, p, O_RDONLY)) == NULL) {
-                        DPRINTF1("HUMAN.SYS open failure.\n");
-                    } else {
-                        DPRINTF1("HUMAN.SYS opened.\n");
-                    }
-                }
-                if (diskinfo[id].sfh != NULL &&
-                    smb2_lseek(diskinfo[id].smb2, diskinfo[id].sfh, lba * 512, SEEK_SET, &cur) >= 0) {
-                    if (smb2_read(diskinfo[id].smb2, diskinfo[id].sfh, buf, 512) != 512) {
-                        smb2_close(diskinfo[id].smb2, diskinfo[id].sfh);
-                        diskinfo[id].sfh = NULL;
-                        humanlbamax = lba;
-                        DPRINTF1("HUMAN.SYS closed.\n");
-                    }
-                }
-                return 0;
-            }
+//****************************************************************************
+// I/O worker
+//****************************************************************************
+
+/*
+ * All the disk accesses which may go to the network are done by the I/O
+ * worker task on the network core. The MSC callbacks on the USB core post
+ * a request and get "busy" until it completes, so the USB stack keeps
+ * running during the SMB2 round trips.
+ * Requests and completions are passed through lock-free SPSC queues. The
+ * USB task is the only producer of vd_reqq and the only consumer of
+ * vd_doneq, and the worker is the other side of both. A request and
+ * vd_iobuf belong to the worker from the post until the completion.
+ */
+
+static void vd_post(struct vd_ioreq *r)
+{
+    r->task = xTaskGetCurrentTaskHandle();
+    spsc_put(&vd_reqq, r);          // never full (two requests at most)
+    xTaskNotify(io_th, VD_NOTIFY_IO, eSetBits);
+}
+
+/* Take the completions from the worker (USB task) */
+static void vd_complete(void)
+{
+    struct vd_ioreq *r;
+
+    while ((r = spsc_get(&vd_doneq)) != NULL) {
+        if (r == &vd_rwreq) {
+            vd_rwbusy = false;
+            vd_rwdone = true;
+        } else {
+            vd_flushbusy = false;
         }
-        if (diskinfo[id].type == DTYPE_REMOTECOMM) {
-            if (lba >= (0x20000 / 512) && lba < (0x40000 / 512)) {
-                // settingui.bin
-                lba -= 0x20000 / 512;
-                if (lba <= sizeof(settingui) / 512) {
-                    memcpy(buf, &settingui[lba * 512], 512);
-                }
-                return 0;
-            } else if (lba >= (0x40000 / 512)) {
-                int page = vdbuf_rcnt + (lba % 8);
-                struct vdbuf *b = (struct vdbuf *)buf;
-                b->header = vdbuf_header;
-                b->header.maxpage = vdbuf_rpages;
-                b->header.page = page;
-                memcpy(b->buf, &vdbuf_read[page * (512 - 16)], sizeof(b->buf));
-                if ((lba % 8) == 7) {
-                    vdbuf_rcnt += 8;
-                }
-                return 0;
-            }
+    }
+}
+
+/*
+ * Called from the MSC callbacks. Returns the number of sectors done,
+ * 0 if the request is still in progress (the callback is called again),
+ * VD_NOT_READY if it needs the connection which is not ready yet,
+ * or VD_IO_ERROR if the I/O worker failed to process the request.
+ */
+int vd_request(bool write, uint32_t lba, uint32_t count, uint8_t *buf)
+{
+    struct vd_ioreq *r = &vd_rwreq;
+    struct diskinfo *di;
+    uint32_t hdslba;
+    int res;
+
+    vd_complete();
+    if (vd_rwbusy) {
+        /*
+         * Sleep until the worker completes the request. Returning "busy"
+         * right away would spin through the USB event queue, as tinyusb
+         * posts a dummy event to call the callback again.
+         */
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(VD_BUSY_WAIT_MS));
+        vd_complete();
+        if (vd_rwbusy)
+            return 0;
+    }
+    if (vd_rwdone) {
+        vd_rwdone = false;
+        if (r->op == (write ? IO_WRITE : IO_READ) && r->lba == lba && r->count == count) {
+            if (r->result < 0)
+                return VD_IO_ERROR;
+            if (!write)
+                memcpy(buf, vd_iobuf, count * SECTOR_SIZE);
+            return count;
         }
+        /* the host gave up the previous request -- start the new one */
     }
 
-    return -1;
+    /*
+     * While connecting, only the regions made in memory (BPB, FAT and
+     * directories) are served. The host retries the rest after NOT READY
+     * rather than the I/O worker keeping the request until connected.
+     */
+    if (!vd_ready && vd_region_sync(lba, count))
+        return VD_NOT_READY;
+
+    /* cache hits are served immediately */
+    if (!write && (di = vd_hds_range(lba, count, &hdslba)) != NULL &&
+        hds_cache_read_cached(di, hdslba, count, buf) == 0)
+        return count;
+
+    /* so are the remote command responses, which are in memory */
+    if (!write && vd_comm_response(lba, count, buf))
+        return count;
+    if (write && (res = vd_comm_command(lba, count, buf)) != 0)
+        return res;
+
+    r->op = write ? IO_WRITE : IO_READ;
+    r->lba = lba;
+    r->count = count;
+    if (write)
+        memcpy(vd_iobuf, buf, count * SECTOR_SIZE);
+    vd_rwbusy = true;
+    vd_post(r);
+    return 0;
 }
 
-static int configtxtlen = 0;
+/* Request to write back the HDS cache (from the USB callbacks) */
+void vd_flush(void)
+{
+    vd_complete();
+    if (vd_flushbusy)
+        return;
+    vd_flushreq.op = IO_FLUSH;
+    vd_flushbusy = true;
+    vd_post(&vd_flushreq);
+}
 
-int vd_write_block(uint32_t lba, uint8_t *buf)
+static void vd_flush_done(void)
 {
-    if (lba == 0x4020) {
-        // Root directory
-        if (memcmp(&buf[32], "CONFIG  TXT", 11) == 0) {
-            configtxtlen = *(uint32_t *)&buf[60];
-        }
-        return 0;
+    vd_complete();
+    while (vd_flushbusy) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vd_complete();
     }
+}
 
-    if (lba >= 0x4120 && lba < 0x4124) {
-        // "config.txt" file update
-        memcpy(&configtxt[(lba - 0x4120) * SECTOR_SIZE], buf, SECTOR_SIZE);
-        if (configtxtlen > 0 &&
-            (lba - 0x4120) == (configtxtlen - 1) / SECTOR_SIZE) {
-                configtxt[configtxtlen] = '\0';
-                configtxt[sizeof(configtxt) - 1] = '\0';
-            config_parse(configtxt);
-            config_write();
-
-            // reboot by watchdog
-            watchdog_enable(500, 1);
-            while (1)
-                ;
-        }
-    }
+/*
+ * Write back the HDS cache and wait for the completion (SYNCHRONIZE CACHE).
+ * The worker processes the requests in order, so the flush comes after
+ * the request in flight, if any.
+ */
+int vd_flush_wait(void)
+{
+    vd_flush_done();        // a flush already posted may not cover the last writes
+    vd_flush();
+    vd_flush_done();
+    return vd_flushreq.result;
+}
 
-    if (lba >= 0x00803fa0) {
-        // "disk0～6.hds" file write
-        lba -= 0x00803fa0;
-        int id = lba / 0x800000;
-        lba %= 0x800000;
-        if (diskinfo[id].type == DTYPE_NOTUSED)
-            return -1;
-        if (lba >= diskinfo[id].sects)
-            return -1;
-        DPRINTF3("disk %d: write 0x%x\n", id, lba);
+void vd_io_task(void *params)
+{
+    struct vd_ioreq *r;
 
-        vd_sync();
+    while (1) {
+        xTaskNotifyWait(0, VD_NOTIFY_IO | VD_NOTIFY_CMD, NULL, pdMS_TO_TICKS(VD_IDLE_MS));
 
-        if (diskinfo[id].type == DTYPE_HDS && diskinfo[id].sfh != NULL) {
-            if (hds_cache_write(diskinfo[id].smb2, diskinfo[id].sfh, lba, buf) < 0)
-                return -1;
-            return 0;
-        }
-        if (diskinfo[id].type == DTYPE_REMOTECOMM) {
-            struct vdbuf *b = (struct vdbuf *)buf;
-            if (b->header.signature != 0x5a383658) {   /* "X68Z" (big endian) */
-                return -1;
+        while ((r = spsc_get(&vd_reqq)) != NULL) {
+            switch (r->op) {
+            case IO_READ:
+                r->result = vd_read_blocks(r->lba, r->count, vd_iobuf);
+                break;
+            case IO_WRITE:
+                r->result = vd_write_blocks(r->lba, r->count, vd_iobuf);
+                break;
+            case IO_FLUSH:
+                r->result = hds_cache_flush();
+                break;
             }
-            vdbuf_header = b->header;
-            memcpy(&vdbuf_write[b->header.page * (512 - 16)], b->buf, sizeof(b->buf));
-            if (b->header.page == b->header.maxpage) {
-                // last page copy
-                int rsize;
-                xSemaphoreTake(remote_sem, portMAX_DELAY);
-                cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 1);
-                if ((rsize = vd_command(vdbuf_write, vdbuf_read)) < 0) {
-                    rsize = remote_serv(vdbuf_write, vdbuf_read);
-                }
-                cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 0);
-                xSemaphoreGive(remote_sem);
-                vdbuf_rpages = (rsize < 0) ? 0 : ((rsize - 1) / (512 - 16));
-                vdbuf_rcnt = 0;
-                DPRINTF3("vdbuf_rpages=%d\n", vdbuf_rpages);
-            }
-            return 0;
+            spsc_put(&vd_doneq, r);
+            xTaskNotifyGive(r->task);
+        }
+        /* the host polls the status sector while the command is running */
+        if (vdcmd.state == VDSTAT_QUEUED) {
+            __mem_fence_acquire();
+            vd_remote_run();
         }
+        hds_cache_idle();
     }
-
-    return -1;
 }
@@ -27,6 +27,7 @@
 #define _VIRTUAL_DISK_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /* virtual disk volume contstants */
 
@@ -34,18 +35,55 @@
 #define CLUSTER_SIZE        32768
 
 #define MAX_CLUSTER         0x100000
+#define MIN_CLUSTER         65525       // FAT32 needs this many clusters at least
 
 #define CLUS_PER_SECT       (CLUSTER_SIZE / SECTOR_SIZE)        // 64
 #define FATENTS_SECT        (SECTOR_SIZE / sizeof(uint32_t))    // 128
-#define FAT_SECTORS         (MAX_CLUSTER / FATENTS_SECT)        // 0x2000
-#define VOLUME_SECTOR_COUNT (0x20 + FAT_SECTORS * 2 + (MAX_CLUSTER - 2) * CLUS_PER_SECT)
-                                                                // 0x4003fa0
+#define MAX_FAT_SECTORS     (MAX_CLUSTER / FATENTS_SECT)        // 0x2000
+#define DATA_LBA            (0x20 + MAX_FAT_SECTORS * 2)        // 0x4020 (cluster #2)
+
+/* volume size in sectors (set by vd_init) */
+extern uint32_t vd_volume_sects;
+
+/* maximum sectors of one request (CFG_TUD_MSC_EP_BUFSIZE / SECTOR_SIZE) */
+#define VD_MAX_SECTS        32
+
+/* I/O worker task notification bits */
+#define VD_NOTIFY_SYNC      1       // connection is ready
+#define VD_NOTIFY_IO        2       // request is posted
+#define VD_NOTIFY_CMD       4       // remote command is queued
+#define VD_IDLE_MS          10      // cache housekeeping interval
+#define VD_BUSY_WAIT_MS     2       // MSC callback waits this long before returning "busy"
+
+#define VD_NOT_READY        (-1)    // vd_request(): connection is not ready yet
+#define VD_IO_ERROR         (-2)    // vd_request(): the request failed
+
+/*
+ * Response window of the remote communication disk (told by CMD_GETINFO).
+ * Each command response is read from the next slot of VDBUF_MAXPAGE sectors,
+ * so the host never reads a response from a sector it may have cached.
+ */
+#define VD_RESP_BASE        0x100000
+#define VD_RESP_SLOTS       0x8000
+
+/* Status sector window (any sector in it is the status of the last command) */
+#define VD_STAT_BASE        0x80000
+#define VD_STAT_SLOTS       0x80000
 
 /* virtual disk function prototypes */
 
+size_t vd_arena_size(void);
 int vd_init(void);
 int vd_read_block(uint32_t lba, uint8_t *buf);
 int vd_write_block(uint32_t lba, uint8_t *buf);
+int vd_read_blocks(uint32_t lba, uint32_t count, uint8_t *buf);
+int vd_write_blocks(uint32_t lba, uint32_t count, uint8_t *buf);
+int vd_request(bool write, uint32_t lba, uint32_t count, uint8_t *buf);
+void vd_flush(void);
+int vd_flush_wait(void);
+void vd_io_task(void *params);
+void vd_connected(void);
+int vd_human_load(void);
 
 /* remote disk information */
 
@@ -60,6 +98,12 @@ struct diskinfo {
     struct smb2_context *smb2;
     uint32_t size;
     int sects;
+    int writeback;              // write-back cache enabled
+    int fatprefetch;            // Human68k FAT aware prefetch enabled
+    int pending;                // async requests in flight
+    uint32_t ra_next;           // next sector expected by a sequential read
+    int ra_level;               // readahead window level
+    uint32_t ra_end;            // end of the last readahead window
 };
 
 extern struct diskinfo diskinfo[7];